@@ -1,1084 +1,607 @@
-#define _CRT_SECURE_NO_WARNINGS
-#include <fcntl.h>
-#ifdef _WIN32
-#include <IO.h>
-#include <Windows.h>
-#else
-#include <unistd.h>
-#endif
-#include <algorithm>
-#include <bitset>
-#include <codecvt>
-#include <ctime>
-#include <cwctype>
-#include <iomanip>
-#include <iostream>
-#include <map>
-#include <stack>
-#include <string.h>
-#include <string>
-#include <vector>
-using namespace std;
-
-class Utility {
-public:
-    static void trim(wstring& string) {
-        int i = string.size() - 1;
-        for (; i >= 0 &&
-            (string[i] == L' ' || string[i] == 0 || string[i] == 0xFFFF);
-            i--)
-            string.pop_back();
-    }
-    static bool endsWith(const wstring& fullString, const wstring& ending) {
-        if (fullString.length() >= ending.length()) {
-            return (fullString.compare(fullString.length() - ending.length(), ending.length(), ending) == 0);
-        }
-        else {
-            return false;
-        }
-    }
-};
-
-class Entry {
-public:
-    union {
-        struct {
-            bool readOnly : 1;
-            bool hidden : 1;
-            bool system : 1;
-            bool volume : 1;
-            bool directory : 1;
-            bool archive : 1;
-            bool device : 1;
-            bool normal : 1;
-        };
-        int32_t data;
-    } attribute;
-    wstring name, extension;
-    uint64_t pos, parentPos;
-    uint64_t size;
-    time_t lastModifiedTime;
-    Entry() {}
-    virtual ~Entry() {}
-    virtual void printName() {
-        wcout << setw(50) << left << name << setw(10) << size;
-        wcout << setw(10) << pos;
-        //char* time = ctime(&lastModifiedTime);
-        //time[strlen(time) - 1] = ' ';
-        //wcout << setw(20) << time;
-    }
-    virtual void printContent() = 0;
-};
-
-class Folder : public Entry {
-protected:
-    vector<Entry*> subEntries;
-
-public:
-    ~Folder() {
-        for (Entry* e : subEntries)
-            delete e;
-    }
-    Entry* find(wstring _name) {
-        for (Entry* entry : subEntries)
-            if (entry->name.compare(_name) == 0)
-                return entry;
-        return 0;
-    }
-    void printContent() {
-        wcout << left << setw(10) << "Status" << setw(50) << left << L"Name"
-            << setw(10) << L"Size";
-        wcout << setw(10) << L"Cluster";
-        //wcout << setw(20) << L"Last Modified Time\n";
-        wcout << L"\n";
-        for (Entry* entry : subEntries)
-            entry->printName();
-    }
-    void printName() {
-        wcout << setw(10) << L"Folder";
-        Entry::printName();
-        wcout << L"\n";
-    }
-    friend class FAT32;
-    friend class NTFS;
-    friend class Filesystem;
-    friend class CMD;
-};
-class File : public Entry {
-protected:
-    void* dataPtr;
-
-public:
-    virtual ~File() { free(dataPtr); }
-    void printContent() {
-        wcout << L"Can't open directly! Please use another program.\n";
-    }
-    void printName() {
-        wcout << setw(10) << L"File";
-        Entry::printName();
-        wcout << L"\n";
-    }
-    friend class FAT32;
-    friend class NTFS;
-};
-class TXT : public File {
-    void printContent() {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wdeprecated"
-        std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
-#pragma GCC diagnostic pop
-        std::wstring wstr = converter.from_bytes((char*)dataPtr, (char*)dataPtr+size);
-        wcout << wstr << endl;
-    }
-    void printName() {
-        wcout << setw(10) << L"TXT";
-        Entry::printName();
-        wcout << L"\n";
-    }
-};
-
-class Filesystem {
-protected:
-#pragma pack(push, 1) /* Byte align in memory (no padding) */
-    struct BIOS_PARAMETER_BLOCK {
-        uint8_t BS_jmpBoot[3]; /* Jump instruction to the boot code */
-        uint8_t BS_OEMName[8]; /* Name of system that formatted the volume */
-        uint16_t bytes_per_sector;           /* Size of a sector in bytes. */
-        uint8_t sectors_per_cluster;         /* Size of a cluster in sectors. */
-        uint16_t reserved_sectors;           /* zero */
-        uint8_t fats;                        /* zero */
-        uint16_t root_entries;               /* zero */
-        uint16_t sectors;                    /* zero */
-        uint8_t media_type;                  /* 0xf8 = hard disk */
-        uint16_t sectors_per_fat;            /* zero */
-        /*0x0d*/ uint16_t sectors_per_track; /* Required to boot Windows. */
-        /*0x0f*/ uint16_t heads;             /* Required to boot Windows. */
-        /*0x11*/ uint32_t hidden_sectors;    /* Offset to the start of the
-                                        partition    relative to the disk in
-                                        sectors.    Required to boot Windows. */
-    } *bpb;
-#pragma pack(pop) /* End strict alignment */
-
-#ifdef _WIN32
-    HANDLE hDisk;
-#else
-    int fd;
-#endif
-public:
-    char* firstSector;
-    Folder* rootDirectory;
-    Filesystem() : firstSector(new char[512]), rootDirectory(0) {
-        bpb = (BIOS_PARAMETER_BLOCK*)firstSector;
-    }
-    Filesystem(wstring diskPath) : Filesystem() {
-#ifdef _WIN32
-        hDisk = CreateFileW(diskPath.c_str(), GENERIC_READ,
-            FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
-            OPEN_EXISTING, 0, NULL);
-#else
-        string str = string(diskPath.begin(), diskPath.end());
-        fd = open(str.c_str(), O_RDONLY);
-#endif
-    }
-    virtual void getData(Entry*) {};
-    virtual void printInfo() {
-        wcout << L"Bytes per sector: " << bpb->bytes_per_sector
-            << L" (bytes)\n";
-        wcout << L"Sectors per cluster: " << (int)bpb->sectors_per_cluster
-            << '\n';
-        wcout << L"Bootsector size: " << bpb->reserved_sectors << '\n';
-        wcout << L"Number of FATs: " << (int)bpb->fats << '\n';
-        wcout << L"Sectors per tracks: " << bpb->sectors_per_track << '\n';
-        wcout << L"Number of heads: " << bpb->heads << '\n';
-        wcout << L"Hidden sectors: " << bpb->hidden_sectors << L" \n";
-    }
-    virtual void readInfo() { read(firstSector, 0, 512); }
-    virtual ~Filesystem() {
-#ifdef _WIN32
-        CloseHandle(hDisk);
-#else
-        close(fd);
-#endif
-        delete[] firstSector;
-        delete rootDirectory;
-    }
-    bool read(void* buffer, uint64_t pos, uint64_t bufferSize) {
-#ifdef _WIN32
-        if (hDisk == INVALID_HANDLE_VALUE)
-            return 0;
-        DWORD bytesRead;
-        LARGE_INTEGER l;
-        l.QuadPart = pos;
-        SetFilePointerEx(hDisk, l, NULL, FILE_BEGIN);
-        if (!ReadFile(hDisk, buffer, bufferSize, &bytesRead, NULL))
-            return 0;
-#else
-        if (fd == -1) {
-            wcout << L"reading failed\n";
-            wcout << L"Error opening the file: " << strerror(errno) << endl;
-            return 0;
-        }
-        lseek(fd, pos, SEEK_SET);
-        ssize_t bytesRead;
-        bytesRead = ::read(fd, buffer, bufferSize);
-        if (bytesRead <= 0)
-            return 0;
-#endif
-        return 1;
-    }
-};
-
-class FAT32 : public Filesystem {
-private:
-#pragma pack(push, 1)            /* Byte align in memory (no padding) */
-    typedef struct {             // (total 16 bits--a unsigned short)
-        unsigned short sec : 5;  // low-order 5 bits are the seconds
-        unsigned short min : 6;  // next 6 bits are the minutes
-        unsigned short hour : 5; // high-order 5 bits are the hour
-    } FATTime;
-    typedef struct {              // (total 16 bits--a unsigned short)
-        unsigned short day : 5;   // low-order 5 bits are the day
-        unsigned short month : 4; // next 4 bits are the month
-        unsigned short year : 7;  // high-order 7 bits are the year
-    } FATDate;
-    struct FAT32BS {
-        uint32_t total_sectors_32;
-        uint32_t table_size_32;
-        uint16_t extended_flags;
-        uint16_t fat_version;
-        uint32_t root_cluster;
-        uint16_t fat_info;
-        uint16_t backup_BS_sector;
-        uint8_t reserved_0[12];
-        uint8_t drive_number;
-        uint8_t reserved_1;
-        uint8_t boot_signature;
-        uint32_t volume_id;
-        uint8_t volume_label[11];
-        uint8_t fat_type_label[8];
-    } *fat32bs;
-#pragma pack(pop) /* End strict alignment */
-    vector<uint32_t> fileAllocationTable;
-
-public:
-    void readInfo() {
-        Filesystem::readInfo();
-        fat32bs = (FAT32BS*)(firstSector + sizeof(BIOS_PARAMETER_BLOCK));
-    }
-    void printInfo() {
-        wcout << L"FAT32 file system\n";
-        Filesystem::printInfo();
-        wcout << L"RDET cluster: " << fat32bs->root_cluster << '\n';
-        wcout << L"Total number of sectors: " << fat32bs->total_sectors_32
-            << '\n';
-        wcout << L"FAT size: " << fat32bs->table_size_32 << '\n';
-    }
-    void readFAT() {
-        fileAllocationTable =
-            vector<uint32_t>(fat32bs->table_size_32 * bpb->bytes_per_sector);
-        read(fileAllocationTable.data(),
-            bpb->reserved_sectors * bpb->bytes_per_sector,
-            fileAllocationTable.size());
-    }
-    vector<Entry*> readDET(int startCluster) {
-        vector<Entry*> directoryTree;
-        char* buffer =
-            (char*)malloc(bpb->sectors_per_cluster * bpb->bytes_per_sector);
-        wstring tempName;
-        while (1) {
-            readCluster(buffer, startCluster);
-            for (char* entry = buffer;
-                entry - buffer <
-                bpb->sectors_per_cluster * bpb->bytes_per_sector;
-                entry += 32) {
-                if (*entry == 0)
-                    goto exit;
-                if (*(unsigned char*)entry == 0xe5)
-                    continue;
-                if (*(entry + 0xb) == 0xF) {
-                    char16_t ucs2Data[13];
-                    memcpy(ucs2Data, entry + 0x1, 10);
-                    memcpy(&ucs2Data[5], entry + 0xe, 12);
-                    memcpy(&ucs2Data[11], entry + 0x1c, 4);
-                    wstring wstr(ucs2Data, ucs2Data + 13);
-                    tempName.insert(0, wstr);
-                }
-                else {
-                    if (*(entry + 0xb) & 0x10)
-                        directoryTree.push_back(new Folder);
-                    else {
-                        if (memcmp(entry + 0x8, "TXT", 3) == 0)
-                            directoryTree.push_back(new TXT);
-                        else
-                            directoryTree.push_back(new File);
-                    }
-                    if (tempName.length() == 0) {
-                        directoryTree.back()->name = wstring(entry, entry + 8);
-                        Utility::trim(directoryTree.back()->name);
-                        if (isalnum(*(char*)(entry + 0x8)))
-                            directoryTree.back()->name.append(
-                                L"." + wstring(entry + 0x8, entry + 0xb));
-                        Utility::trim(directoryTree.back()->name);
-                        transform(directoryTree.back()->name.begin(),
-                            directoryTree.back()->name.end(),
-                            directoryTree.back()->name.begin(),
-                            ::tolower);
-
-                    }
-                    else {
-                        directoryTree.back()->name = tempName;
-                        tempName.clear();
-                        Utility::trim(directoryTree.back()->name);
-                    }
-                    directoryTree.back()->pos =
-                        *(uint16_t*)(entry + 0x1a) |
-                        ((*(uint16_t*)(entry + 0x14)) << 16);
-                    if (directoryTree.back()->pos == 0)
-                        directoryTree.back()->pos = fat32bs->root_cluster;
-                    directoryTree.back()->size = *(uint32_t*)(entry + 0x1c);
-                    directoryTree.back()->attribute.data =
-                        *(uint8_t*)(entry + 0xb);
-
-                    FATTime* time = (FATTime*)(entry + 0x16);
-                    FATDate* date = (FATDate*)(entry + 0x18);
-                    tm input_time = { 0 };
-                    input_time.tm_year = date->year + 1980 - 1900;
-                    input_time.tm_mon = date->month - 1;
-                    input_time.tm_mday = date->day;
-                    input_time.tm_hour = time->hour;
-                    input_time.tm_min = time->min;
-                    input_time.tm_sec = time->sec;
-                    directoryTree.back()->lastModifiedTime =
-                        mktime(&input_time);
-                }
-            }
-            startCluster++;
-        }
-    exit:
-        free(buffer);
-        return directoryTree;
-    }
-    FAT32() {}
-    FAT32(wstring diskPath) : Filesystem(diskPath) {
-        readInfo();
-        readFAT();
-        rootDirectory = new Folder;
-        rootDirectory->pos = fat32bs->root_cluster;
-        getData(rootDirectory);
-    }
-
-    bool readCluster(void* buffer, uint32_t cluster) {
-        return read(
-            buffer,
-            bpb->bytes_per_sector *
-            ((bpb->reserved_sectors + bpb->fats * fat32bs->table_size_32) +
-                (cluster - 2) * bpb->sectors_per_cluster),
-            bpb->sectors_per_cluster * bpb->bytes_per_sector);
-    }
-    void getData(Entry* e) {
-        if (dynamic_cast<File*>(e)) {
-            vector<uint32_t> clusters;
-            for (uint32_t i = e->pos;
-                i < (fat32bs->total_sectors_32 / bpb->sectors_per_cluster) &&
-                fileAllocationTable[i] != 0;
-                i = fileAllocationTable[i])
-                clusters.push_back(i);
-            void* data = malloc(clusters.size() * bpb->bytes_per_sector *
-                bpb->sectors_per_cluster);
-            for (uint32_t i = 0; i < clusters.size(); i++)
-                readCluster((char*)data + i * bpb->bytes_per_sector *
-                    bpb->sectors_per_cluster,
-                    clusters[i]);
-            dynamic_cast<File*>(e)->dataPtr = data;
-        }
-        else {
-            dynamic_cast<Folder*>(e)->subEntries = readDET(e->pos);
-        }
-    }
-};
-
-class NTFS : public Filesystem {
-private:
-#pragma pack(push, 1) /* Byte align in memory (no padding) */
-    struct NTFSBS {
-        /*0x15*/ uint32_t large_sectors; /* zero */
-        uint8_t physical_drive;          /* 0x00 floppy, 0x80 hard disk */
-        uint8_t current_head;            /* zero */
-        uint8_t extended_boot_signature; /* 0x80 */
-        uint8_t reserved2;               /* zero */
-        /*0x28*/ int64_t number_of_sectors;
-        uint64_t mft_lcn;                /* Cluster location of mft data. */
-        uint64_t mftmirr_lcn;            /* Cluster location of copy of mft. */
-        uint8_t clusters_per_mft_record; /* Mft record size in clusters. */
-        uint8_t reserved0[3];            /* zero */
-        uint8_t clusters_per_index_record; /* Index block size in clusters. */
-        uint8_t reserved1[3];              /* zero */
-        uint64_t volume_serial_number;     /* Irrelevant (serial number). */
-        uint32_t checksum;                 /* Boot sector checksum. */
-        /*0x54*/ uint8_t bootstrap[426];   /* Irrelevant (boot up code). */
-        uint16_t end_of_sector_marker;     /* End of bootsector magic. Always is
-                                              0xaa55 in little endian. */
-                                              /* sizeof() = 512 (0x200) bytes */
-    } *ntfsbs;
-
-    struct MFT_REFERENCE {
-        uint64_t indx : 48;
-        uint64_t sequenceNumber : 16;
-    };
-
-    typedef struct {
-        uint32_t magic;     /* Usually the magic is "FILE". */
-        uint16_t usa_ofs;   /* See NTFS_RECORD definition above. */
-        uint16_t usa_count; /* See NTFS_RECORD definition above. */
-        /*  8*/ uint64_t lsn;
-        /* 16*/ uint16_t sequence_number;
-        /* 18*/ uint16_t link_count;
-        /* 20*/ uint16_t attrs_offset;
-        /* 22*/ uint16_t flags;
-        /* 24*/ uint32_t bytes_in_use;
-        /* 28*/ uint32_t bytes_allocated;
-        /* 32*/ MFT_REFERENCE base_mft_record;
-        uint16_t next_attr_instance;
-        /* 42*/ uint16_t reserved;          /* Reserved/alignment. */
-        /* 44*/ uint32_t mft_record_number; /* Number of this mft record. */
-    } MFT_RECORD;
-
-    typedef struct {
-        /*Ofs*/
-        /*  0*/ uint32_t type; /* The (32-bit) type of the attribute. */
-        /*  4*/ uint32_t length;
-        /*  8*/ uint8_t non_resident;
-        /*  9*/ uint8_t name_length;
-        /* 10*/ uint16_t name_offset;
-        /* 12*/ uint16_t flags; /* Flags describing the attribute. */
-        /* 14*/ uint16_t instance;
-        /* 16*/ union {
-            struct {
-                /* 16 */ uint32_t
-                    value_length; /* Byte size of attribute value. */
-                /* 20 */ uint16_t value_offset;
-                /* 22 */ uint8_t resident_flags; /* See above. */
-                /* 23 */ int8_t reservedR;
-                /* 24 */ void* resident_end[0];
-            };
-            struct {
-                /* 16*/ uint64_t lowest_vcn;
-                /* 24*/ uint64_t highest_vcn;
-                /* 32*/ uint16_t mapping_pairs_offset;
-                /* 34*/ uint8_t compression_unit;
-                /* 35*/ uint8_t reserved1[5];
-                /* 40*/ int64_t allocated_size;
-                /* 48*/ int64_t data_size;
-                /* 56*/ int64_t initialized_size;
-                /* 64 */ int64_t non_resident_end;
-                /* 72 */ void* compressed_end[0];
-            };
-        };
-    } ATTR_RECORD;
-
-    typedef struct {
-        /*  0*/ uint32_t type;   /* Type of referenced attribute. */
-        /*  4*/ uint16_t length; /* Byte size of this entry. */
-        /*  6*/ uint8_t name_length;
-        /*  7*/ uint8_t name_offset;
-        /*  8*/ uint64_t lowest_vcn;
-        /* 16*/ MFT_REFERENCE mft_reference;
-        /* 24*/ uint32_t instance;
-        /* 26*/ uint16_t name[0];
-    } ATTR_LIST_ENTRY;
-
-    typedef struct {
-        /*  0*/ uint32_t entries_offset;
-        /*  4*/ uint32_t index_length;
-        /*  8*/ uint32_t allocated_size;
-        /* 12*/ uint8_t ih_flags;    /* Bit field of INDEX_HEADER_FLAGS.  */
-        /* 13*/ uint8_t reserved[3]; /* Reserved/align to 8-byte boundary.*/
-    } INDEX_HEADER;
-
-    typedef struct {
-        /*  0*/ uint32_t type;
-        /*  4*/ uint32_t collation_rule;
-        /*  8*/ uint32_t index_block_size;
-        /* 12*/ int8_t clusters_per_index_block;
-        /* 13*/ uint8_t reserved[3]; /* Reserved/align to 8-byte boundary. */
-        /* 16*/ INDEX_HEADER index;
-    } INDEX_ROOT;
-
-    typedef struct {
-        uint32_t magic;     /* Magic is "INDX". */
-        uint16_t usa_ofs;   /* See NTFS_RECORD definition. */
-        uint16_t usa_count; /* See NTFS_RECORD definition. */
-        /*  8*/ uint64_t lsn;
-        /* 16*/ uint64_t index_block_vcn;
-        /* 24*/ INDEX_HEADER index; /* Describes the following index entries. */
-    } INDEX_ALLOCATION;
-
-    typedef struct {
-        union { /* Only valid when INDEX_ENTRY_END is not set. */
-            MFT_REFERENCE indexed_file;
-            struct {
-                uint16_t data_offset;
-                uint16_t data_length; /* Data length in bytes. */
-                uint32_t reservedV;   /* Reserved (zero). */
-            };
-        };
-        /*  8*/ uint16_t length;
-        /* 10*/ uint16_t key_length;
-        /* 12*/ uint16_t ie_flags; /* Bit field of INDEX_ENTRY_* flags. */
-        /* 14*/ uint16_t reserved;
-    } INDEX_ENTRY;
-
-    typedef struct {
-        /*  0*/ MFT_REFERENCE parent_directory;
-        /*  8*/ int64_t creation_time; /* Time file was created. */
-        /* 10*/ int64_t last_data_change_time;
-        /* 18*/ int64_t last_mft_change_time;
-        /* 20*/ int64_t last_access_time;
-        /* 28*/ int64_t allocated_size;
-        /* 30*/ int64_t data_size;
-        /* 38*/ uint32_t file_attributes; /* Flags describing the file. */
-        /* 3c*/ union {
-            /* 3c*/ struct {
-                /* 3c*/ uint16_t packed_ea_size;
-                /* 3e*/ uint16_t reserved; /* Reserved for alignment. */
-            };
-            /* 3c*/ uint32_t reparse_point_tag;
-        };
-        /* 40*/ uint8_t file_name_length;
-        /* 41*/ uint8_t file_name_type; /* Namespace of the file name.*/
-        /* 42*/ char16_t* file_name;    /* File name in Unicode. */
-    } FILE_NAME_ATTR;
-
-#pragma pack(pop) /* End strict alignment */
-    uint64_t clusters_per_index_record, clusters_per_mft_record,
-        sectors_per_cluster;
-    bool mft_record_size_in_bytes;
-
-    time_t convertWindowsTimeToUnixTime(long long int input) {
-        long long int temp;
-        temp = input / 10000000; // convert from 100ns intervals to seconds;
-        temp =
-            temp - 11644473600LL; // subtract number of seconds between epochs
-        return (time_t)temp;
-    }
-
-    void restoreFixup(char* data, uint16_t* fixupArray, int n) {
-        char* sector = data + bpb->bytes_per_sector;
-        for (int i = 0; i < n-1; i++, sector += bpb->bytes_per_sector)
-            *(uint16_t*)(sector - 2) = fixupArray[i];
-    }
-
-public:
-    NTFS(wstring diskPath) : Filesystem(diskPath) {
-        readInfo();
-        rootDirectory = (Folder*)readMFTEntry(0, 5);
-        //test->printName();
-        //rootDirectory->pos = 5;
-        //getData(rootDirectory);
-    }
-    void readInfo() {
-        Filesystem::readInfo();
-        ntfsbs = (NTFSBS*)(firstSector + sizeof(BIOS_PARAMETER_BLOCK));
-        sectors_per_cluster = (bpb->sectors_per_cluster >= 244)
-            ? 1 << (256 - bpb->sectors_per_cluster)
-            : bpb->sectors_per_cluster;
-        clusters_per_index_record =
-            (ntfsbs->clusters_per_index_record > 127)
-            ? 1 << (256 - ntfsbs->clusters_per_index_record)
-            : ntfsbs->clusters_per_index_record;
-        if (ntfsbs->clusters_per_mft_record > 127) {
-            clusters_per_mft_record =
-                1 << (256 - ntfsbs->clusters_per_mft_record);
-            mft_record_size_in_bytes = true;
-        }
-        else {
-            mft_record_size_in_bytes = false;
-            clusters_per_mft_record = ntfsbs->clusters_per_mft_record;
-        }
-    }
-    void printInfo() {
-        wcout << L"NTFS file system\n";
-        Filesystem::printInfo();
-        wcout << L"Total number of sectors: " << ntfsbs->number_of_sectors
-            << '\n';
-        wcout << L"MFT cluster: " << ntfsbs->mft_lcn << '\n';
-        wcout << L"Clusters per Index block: " << clusters_per_index_record
-            << '\n';
-        wcout << L"Clusters per MFT record: " << clusters_per_mft_record;
-        if (mft_record_size_in_bytes)
-            wcout << " (bytes)\n";
-        else
-            wcout << " (sectors)\n";
-    }
-    bool readCluster(void* buffer, uint64_t cluster) {
-        return read(buffer,
-            bpb->bytes_per_sector * cluster * sectors_per_cluster,
-            sectors_per_cluster * bpb->bytes_per_sector);
-    }
-    void readMFT() {}
-    void getMFTEntryData(char*& buffer, uint64_t indx) {
-        buffer = new char[clusters_per_mft_record *
-            (mft_record_size_in_bytes
-                ? 1
-                : sectors_per_cluster * bpb->bytes_per_sector)];
-        if (mft_record_size_in_bytes)
-            read(buffer,
-                indx * clusters_per_mft_record + ntfsbs->mft_lcn *sectors_per_cluster *bpb->bytes_per_sector,
-                clusters_per_mft_record);
-        else
-            for (int i = 0; i < clusters_per_mft_record; i++)
-                readCluster(buffer, (indx + i) * clusters_per_mft_record +
-                    ntfsbs->mft_lcn);
-        MFT_RECORD* mftrc = (MFT_RECORD*)buffer;
-        restoreFixup((char*)mftrc,
-            (uint16_t*)(mftrc->usa_ofs + (char*)mftrc),
-            mftrc->usa_count);
-    }
-    void readFilenameAttribute(Entry*& rt, char* attributeData) {
-        rt->parentPos = ((MFT_REFERENCE*)attributeData)->indx;
-        unsigned char nameSpace = *(uint8_t*)(attributeData + 65);
-        rt->size=  *(uint64_t*)(attributeData + 48);
-        if (1) { // win32 namespace
-            unsigned char size = *(uint8_t*)(attributeData + 64);
-            vector<char16_t> ucs2Data(size);
-            memcpy(ucs2Data.data(), attributeData + 66,
-                size * sizeof(char16_t));
-            rt->name = wstring(ucs2Data.begin(),
-                ucs2Data.end());
-        }
-    }
-    void readStandardInfomationAttribute(Entry* rt, char* attributeData) {
-        rt->attribute.data = *(int32_t*)(attributeData + 32);
-        rt->lastModifiedTime =
-            convertWindowsTimeToUnixTime(*(int64_t*)(attributeData + 8));
-    }
-    Entry* readMFTEntry(Entry* rt, uint64_t indx) {
-        map<uint64_t, pair<char*, char*>> buffer;
-        buffer[indx].first = 0;
-        getMFTEntryData(buffer[indx].first, indx);
-        MFT_RECORD* mftrc = (MFT_RECORD*)buffer[indx].first;
-        if (!rt) {
-            if (mftrc->flags & 0x0002)
-                rt = new Folder;
-            else
-                rt = new File;
-        }
-        buffer[indx].second = mftrc->attrs_offset + (char*)mftrc;
-        vector<pair<uint32_t, uint64_t>> attributes;
-        bool useAttributeList = false;
-        int currentAttributes = 0;
-        bool chain = false;
-        uint64_t lastWritten = 0;
-        char* attributeData = 0;
-        char* indexAlloc=0,*indexRoot = 0;
-        while (1) {
-            uint64_t currentIndex =
-                useAttributeList ? attributes[currentAttributes].second : indx;
-            MFT_RECORD* mftrc = (MFT_RECORD*)buffer[currentIndex].first;
-            ATTR_RECORD* attributePtr =
-                (ATTR_RECORD*&)buffer[currentIndex].second;
-            while (1) {
-                if ((((char*)attributePtr - (char*)mftrc) >
-                    clusters_per_mft_record *
-                    (mft_record_size_in_bytes
-                        ? 1
-                        : sectors_per_cluster * bpb->bytes_per_sector)))
-                    break;
-                if (*(int32_t*)attributePtr == -1)
-                    break;
-
-                // getData
-                if (attributePtr->non_resident == 0) {
-                    if (chain) {
-                        char* data = (char*)realloc(
-                            attributeData, attributePtr->value_length);
-                        if (data)
-                            attributeData = data;
-                        memcpy(attributeData + lastWritten,
-                            attributePtr->value_offset +
-                            (char*)attributePtr,
-                            attributePtr->value_length);
-                    }
-                    else {
-                        attributeData =
-                            (char*)malloc(attributePtr->value_length);
-                        memcpy(attributeData,
-                            attributePtr->value_offset +
-                            (char*)attributePtr,
-                            attributePtr->value_length);
-                    }
-                    lastWritten += attributePtr->value_length;
-                }
-                else {
-                    char* dataRunStart = attributePtr->mapping_pairs_offset +
-                        (char*)attributePtr;
-                    uint64_t totalSize = attributePtr->highest_vcn -
-                        attributePtr->lowest_vcn + 1;
-                    vector<pair<int, int>> dataRuns;
-                    while (1) {
-                        uint8_t clusterAddressOffsetFieldSize =
-                            *(uint8_t*)dataRunStart >> 4;
-                        uint8_t clusterNumberFieldSize =
-                            *(uint8_t*)dataRunStart & 15;
-                        int64_t* clusterNumber =
-                            (int64_t*)malloc(clusterNumberFieldSize);
-                        int64_t* clusterAddressOffset =
-                            (int64_t*)malloc(clusterAddressOffsetFieldSize);
-                        *clusterNumber = 0, * clusterAddressOffset = 0;
-                        memcpy(clusterNumber, dataRunStart + 1,
-                            clusterNumberFieldSize);
-                        memcpy(clusterAddressOffset,
-                            dataRunStart + 1 + clusterNumberFieldSize,
-                            clusterAddressOffsetFieldSize);
-                        *clusterNumber =
-                            *clusterNumber
-                            << ((8 - clusterNumberFieldSize) * 8) >>
-                            ((8 - clusterNumberFieldSize) * 8);
-                        *clusterAddressOffset =
-                            *clusterAddressOffset
-                            << ((8 - clusterAddressOffsetFieldSize) * 8) >>
-                            ((8 - clusterAddressOffsetFieldSize) * 8);
-                        if (*clusterNumber == 0)
-                            break;
-                        if (dataRuns.empty())
-                            dataRuns.push_back(
-                                { *clusterNumber, *clusterAddressOffset });
-                        else
-                            dataRuns.push_back(
-                                { *clusterNumber, *clusterAddressOffset +
-                                                     dataRuns.back().second });
-                        dataRunStart += 1 + clusterNumberFieldSize +
-                            clusterAddressOffsetFieldSize;
-                    }
-
-                    int totalCluster = 0;
-                    for (auto x : dataRuns)
-                        totalCluster += x.first;
-                    if (chain) {
-                        char* data = (char*)realloc(
-                            attributeData, (lastWritten+ totalCluster * sectors_per_cluster *
-                                bpb->bytes_per_sector));
-                        if (data)
-                            attributeData = data;
-                    }
-                    else
-                        attributeData =
-                        (char*)malloc(totalCluster * sectors_per_cluster *
-                            bpb->bytes_per_sector);
-                    for (auto run : dataRuns) {
-                        for (int i = 0; i < run.first;
-                            i++, lastWritten +=
-                            sectors_per_cluster * bpb->bytes_per_sector)
-                            readCluster(attributeData + lastWritten,
-                                run.second + i);
-                    }
-                }
-                ATTR_RECORD* nextAttributePtr;
-                bool switchIndex = useAttributeList &&
-                    currentAttributes < attributes.size() - 1 &&
-                    attributes[currentAttributes].second !=
-                    attributes[currentAttributes + 1].second;
-                if (switchIndex)
-                    nextAttributePtr =
-                    (ATTR_RECORD
-                        *)(buffer[attributes[currentAttributes + 1].second]
-                            .second);
-                else
-                    nextAttributePtr = (ATTR_RECORD*)((char*)attributePtr +
-                        attributePtr->length);
-
-                chain = (attributePtr->type == // attribute chains
-                    nextAttributePtr->type && nextAttributePtr->length==0);
-                if (chain)
-                    goto nextAttribute;
-
-                switch (*(uint32_t*)attributePtr) {
-                case 0x00000010: //$STANDARD_INFORMATION
-                    readStandardInfomationAttribute(rt, attributeData);
-                    free(attributeData);
-                    break;
-                case 0x00000030: //$FILE_NAME
-                    readFilenameAttribute(rt, attributeData);
-                    free(attributeData);
-                    break;
-                case 0x00000080: //$DATA
-                {
-                    File* file = dynamic_cast<File*>(rt);
-                    if (rt->size == 0) rt->size = lastWritten;
-                    if (file) {
-                        file->dataPtr = malloc(file->size);
-                        memcpy(file->dataPtr, attributeData, file->size);
-                    }
-                    free(attributeData);
-                } break;
-                case 0x00000020: //$ATTRIBUTE_LIST
-                {
-                    useAttributeList = true;
-                    ATTR_LIST_ENTRY* attr_list =
-                        (ATTR_LIST_ENTRY*)attributeData;
-                    ATTR_LIST_ENTRY* attr_list_original = attr_list;
-                    while (1) {
-                        if (((char*)attr_list - (char*)attr_list_original) >=
-                            ((ATTR_RECORD*)attributePtr)->value_length)
-                            break;
-                        uint64_t index = attr_list->mft_reference.indx;
-                        attributes.push_back({ attr_list->type, index });
-                        attr_list = (ATTR_LIST_ENTRY*)((char*)attr_list +
-                            attr_list->length);
-                    }
-                    for (auto& a : attributes) {
-                        if (buffer.find(a.second) == buffer.end()) {
-                            buffer[a.second] = { 0, 0 };
-                            getMFTEntryData(buffer[a.second].first, a.second);
-                            MFT_RECORD* mftrc =
-                                (MFT_RECORD*)buffer[a.second].first;
-                            buffer[a.second].second =
-                                mftrc->attrs_offset + (char*)mftrc;
-                        }
-                    }
-                    free(attributeData);
-                } break;
-                case 0x00000090: //$INDEX_ROOT
-                {
-                    indexRoot = attributeData;
-                } break;
-                case 0x000000a0: //$INDEX_ALLOCATION
-                {
-                    indexAlloc = attributeData;
-                }   break;
-                case 0x000000b0: //$BITMAP
-                    break;
-                default:
-                    free(attributeData);
-                }
-            nextAttribute:
-
-                if (!chain)
-                    lastWritten = 0;
-                buffer[currentIndex].second =
-                    ((char*)attributePtr + attributePtr->length);
-                attributePtr = nextAttributePtr;
-                if (useAttributeList)
-                    currentAttributes++;
-                if (switchIndex)
-                    break;
-            }
-            if (!useAttributeList ||
-                (useAttributeList && currentAttributes >= attributes.size()))
-                break;
-        }
-
-        if (dynamic_cast<Folder*>(rt))
-            dynamic_cast<Folder*>(rt)->subEntries=readIndex(indexRoot, 1, indexAlloc);
-       
-        return rt;
-    }
-    vector<Entry*> readIndex(char* attributeData, bool root,char* indexAlloc) {
-        vector<Entry*> rt;
-        INDEX_ENTRY* indexEntryStart,*end;
-        if (root) {
-            INDEX_ROOT* indxRt = (INDEX_ROOT*)attributeData;
-            indexEntryStart =
-                (INDEX_ENTRY*)(indxRt->index.entries_offset +
-                    (char*) & indxRt->index);
-            end =
-                (INDEX_ENTRY*)(indxRt->index.index_length +
-                    (char*)&indxRt->index);
-        }
-        else {
-            INDEX_ALLOCATION* indxRt = (INDEX_ALLOCATION*)attributeData;
-            restoreFixup((char*)indxRt, (uint16_t*)(indxRt->usa_ofs + (char*)indxRt), indxRt->usa_count);
-            indexEntryStart =
-                (INDEX_ENTRY*)(indxRt->index.entries_offset +
-                    (char*)&indxRt->index);
-            end =
-                (INDEX_ENTRY*)(indxRt->index.index_length +
-                    (char*)&indxRt->index);
-        }
-
-        while (indexEntryStart<end) {
-            INDEX_ENTRY* i = indexEntryStart;
-            if (i->key_length > 0) {
-                Entry* e;
-                if (*(uint32_t*)((char*)i + sizeof(INDEX_ENTRY) + 56) &
-                    0x10000000)
-                    e = new Folder;
-                else
-                    e = new File;
-                readFilenameAttribute(e, (char*)i + 16);
-                if (dynamic_cast<File*>(e)
-                    && Utility::endsWith(e->name, wstring(L".txt")))
-                {
-                    TXT* newE = new TXT;
-                    delete e;
-                    e = newE;
-                    readFilenameAttribute(e, (char*)i + 16);
-                }
-                readStandardInfomationAttribute(e, (char*)i +
-                    16 + 8);
-                e->pos = i->indexed_file.indx;
-                if (e->name[0] == L'$')
-                    delete e;
-                else
-                    rt.push_back(e);
-            }
-            if (indexAlloc!=0&&(i->ie_flags & 1)) {
-                uint64_t vcn = *(uint64_t*)((char*)i + i->length - 8);
-                vector<Entry*> recur=(readIndex(indexAlloc +
-                    vcn * sectors_per_cluster * bpb->bytes_per_sector,false, indexAlloc));
-                rt.insert(rt.end(), recur.begin(), recur.end());
-                for (size_t i = 0; i < rt.size(); ++i) {
-                    for (size_t j = i + 1; j < rt.size(); ++j) {
-                        // If a duplicate is found, erase it from the vector
-                        if (rt[i]->pos == rt[j]->pos) {
-                            if (rt[i]->name.size()> rt[j]->name.size()){
-                            rt.erase(rt.begin() + j);
-                            --j; // Adjust the loop variable to stay at the current index
-                            }
-                            else {
-                                rt.erase(rt.begin() + i);
-                                --i; // Adjust the loop variable to stay at the current index
-                            }
-                        }
-                    }
-                }
-            }
-            if (indexAlloc != 0 && (i->ie_flags & 2))
-                break;
-            indexEntryStart =
-                (INDEX_ENTRY*)((char*)indexEntryStart +
-                    indexEntryStart->length);
-        }
-        for (size_t i = 0; i < rt.size(); ++i) {
-            for (size_t j = i + 1; j < rt.size(); ++j) {
-                // If a duplicate is found, erase it from the vector
-                if (rt[i]->pos == rt[j]->pos) {
-                    if (rt[i]->name.size() > rt[j]->name.size()) {
-                        rt.erase(rt.begin() + j);
-                        --j; // Adjust the loop variable to stay at the current index
-                    }
-                    else {
-                        rt.erase(rt.begin() + i);
-                        --i; // Adjust the loop variable to stay at the current index
-                    }
-                }
-            }
-        }
-        return rt;
-        
-    }
-    void getData(Entry* entry) { 
-        if (dynamic_cast<TXT*>(entry)||dynamic_cast<Folder*>(entry))
-        readMFTEntry(entry, entry->pos); }
-};
-
-class CMD {
-private:
-    Filesystem* fs;
-    stack<Folder*> currentDir;
-    wstring diskPath;
-    void printCurrentDir(stack<Folder*> currentDir) {
-        if (currentDir.empty())
-            return;
-        Folder* t = currentDir.top();
-        currentDir.pop();
-        printCurrentDir(currentDir);
-        wcout << t->name << L"/";
-        currentDir.push(t);
-    }
-    Filesystem* getFS(wstring diskPath) {
-        Filesystem fs(diskPath);
-        fs.readInfo();
-        if (strncmp(fs.firstSector + 0x52, "FAT32", 5) == 0)
-            return new FAT32(diskPath);
-        if (strncmp(fs.firstSector + 3, "NTFS", 4) == 0)
-            return new NTFS(diskPath);
-        return 0;
-    }
-
-public:
-    CMD() {}
-    ~CMD() { delete fs; }
-    void run() {
-        wcout << L"Input disk: ";
-        getline(wcin, diskPath);
-#ifdef _WIN32
-        diskPath = L"\\\\.\\" + diskPath + L":";
-#else
-        diskPath = L"/dev/" + diskPath;
-#endif
-        fs = getFS(diskPath);
-        if (fs == 0) {
-            wcout << L"Not supported filesystem!\n";
-            return;
-        }
-        currentDir.push(fs->rootDirectory);
-        wstring commandInput;
-        while (1) {
-            printCurrentDir(currentDir);
-            getline(wcin, commandInput);
-            wstring command =
-                commandInput.substr(0, commandInput.find_first_of(' '));
-            if (command == L"dir" || command == L"ls")
-                currentDir.top()->printContent();
-            else if (command == L"info")
-                fs->printInfo();
-            else if (command == L"cls" || command == L"clear")
-                system("clear || cls");
-            else if (command == L"exit")
-                return;
-            else if (command == L"open" || command == L"cd") {
-                wstring argument =
-                    commandInput.substr(commandInput.find_first_of(' ') + 1);
-
-                if (argument == L".")
-                    continue;
-                else if (argument == L"..")
-                    currentDir.pop();
-                else {
-                    Entry* found = currentDir.top()->find(
-                        wstring(argument.begin(), argument.end()));
-                    if (found) {
-                        fs->getData(found);
-                        if (command == L"cd") {
-                            if (dynamic_cast<Folder*>(found))
-                                currentDir.push(dynamic_cast<Folder*>(found));
-                            else
-                                wcout << L"Can't change directory to a file!\n";
-                        }
-                        else
-                            found->printContent();
-                    }
-                    else
-                        wcout << L"Doesn't found!\n";
-                }
-            }
-            else if (command == L"help")
-                showHelp();
-            else
-                wcout << L"Wrong command! Type help for more info.\n";
-        }
-    }
-    void showHelp() {
-        wcout << L"dir/ls - print content of current directory\n";
-        wcout << L"open - open file\n";
-        wcout << L"cd - open directory\n";
-        wcout << L"info - print info about filesystem\n";
-        wcout << L"cls/clear - clear screen\n";
-        wcout << L"exit - exit program\n";
-    }
-};
-
-int main() {
-#ifdef _WIN32
-    _setmode(_fileno(stdout), _O_U16TEXT);
-    _setmode(_fileno(stdin), _O_U16TEXT);
-#else
-    locale::global(locale("en_US.UTF-8"));
-    wcout.imbue(locale());
-    wcin.imbue(locale());
-#endif
-    CMD cmd;
-    cmd.run();
-}
-
+#define _CRT_SECURE_NO_WARNINGS
+#include "Filesystem.h"
+#include <sstream>
+#include <stack>
+using namespace std;
+using namespace fsread;
+
+class CMD {
+private:
+    Filesystem* fs;
+    vector<Filesystem*> volumes;
+    vector<wstring> volumeNames;
+    size_t currentVolume;
+    stack<Folder*> currentDir;
+    wstring diskPath;
+    bool directIO;
+    uint64_t cacheBudget;
+    map<Filesystem*, unique_ptr<ClusterMap>> clusterMaps; // built on demand
+    void printCurrentDir(stack<Folder*> currentDir) {
+        if (currentDir.empty())
+            return;
+        Folder* t = currentDir.top();
+        currentDir.pop();
+        printCurrentDir(currentDir);
+        wcout << t->name << L"/";
+        currentDir.push(t);
+    }
+    // Directories on the current path are pinned in the content cache.
+    void enterDir(Folder* folder) {
+        folder->pin();
+        currentDir.push(folder);
+    }
+    void leaveDir() {
+        currentDir.top()->unpin();
+        currentDir.pop();
+    }
+    // The current directory is only loaded once an entry in it is looked up
+    // or it is listed sorted, so paging through a huge one streams it.
+    Entry* findInCurrentDir(const wstring& name) {
+        fs->load(currentDir.top());
+        return currentDir.top()->find(name);
+    }
+    // Refresh may free directories on the current path, so leave them for
+    // the root first and keep only their names.
+    vector<wstring> leaveCurrentDir() {
+        vector<wstring> path;
+        while (currentDir.size() > 1) {
+            path.push_back(currentDir.top()->name);
+            leaveDir();
+        }
+        return path;
+    }
+    // Walk a path left by leaveCurrentDir again by name.
+    void restoreCurrentDir(const vector<wstring>& path) {
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            Folder* next = dynamic_cast<Folder*>(findInCurrentDir(*it));
+            if (!next) {
+                wcout << L"Directory " << *it << L" no longer exists!\n";
+                break;
+            }
+            enterDir(next);
+        }
+    }
+    static void formatHeader(wstring& out) {
+        Utility::pad(out, L"Status", 10);
+        Utility::pad(out, L"Name", 50);
+        Utility::pad(out, L"Size", 10);
+        Utility::pad(out, L"Cluster", 10);
+        out += L'\n';
+    }
+    static void formatEntry(wstring& out, Entry* e) {
+        Utility::pad(out, e->typeName(), 10);
+        Utility::pad(out, e->name, 50);
+        Utility::pad(out, to_wstring(e->size), 10);
+        Utility::pad(out, to_wstring(e->pos), 10);
+        out += L'\n';
+    }
+    // The listing is built in one buffer and written in large pieces.
+    static void printFolder(Folder* folder) {
+        wstring out;
+        formatHeader(out);
+        for (Entry* entry : folder->entries()) {
+            formatEntry(out, entry);
+            if (out.size() >= 1 << 16) {
+                wcout << out;
+                out.clear();
+            }
+        }
+        wcout << out;
+    }
+    void printInfo() {
+        wcout << fs->typeName() << L" file system\n";
+        vector<pair<wstring, wstring>> fields;
+        fs->info(fields);
+        for (auto& field : fields)
+            wcout << field.first << L": " << field.second << L"\n";
+    }
+    // Print up to count lines, returns how many were printed.
+    static uint64_t printLines(TextPager& pager, uint64_t count = UINT64_MAX) {
+        wstring line;
+        uint64_t printed = 0;
+        while (printed < count && pager.nextLine(line)) {
+            wcout << line << L'\n';
+            printed++;
+        }
+        return printed;
+    }
+    static constexpr uint64_t pageLines = 24;
+    TextPager openText(Entry* file) {
+        Filesystem* volume = fs;
+        return TextPager(
+            [volume, file](uint64_t offset, char* buffer, uint64_t length) {
+                return volume->readFile(file, offset, buffer, length);
+            },
+            volume->fileSize(file));
+    }
+    // head/tail [n] <file> and less <file>. Only the part of the file that
+    // is shown gets read.
+    void page(const wstring& command, const wstring& commandInput) {
+        size_t space = commandInput.find_first_of(' ');
+        wstring argument =
+            space == wstring::npos ? L"" : commandInput.substr(space + 1);
+        uint64_t count = 10;
+        if (command != L"less" && !argument.empty() && iswdigit(argument[0])) {
+            size_t end = argument.find_first_of(' ');
+            if (end != wstring::npos) {
+                count = wcstoull(argument.c_str(), 0, 10);
+                argument.erase(0, end + 1);
+            }
+        }
+        File* file = dynamic_cast<File*>(findInCurrentDir(argument));
+        if (!file) {
+            wcout << L"Doesn't found!\n";
+            return;
+        }
+        TextPager pager = openText(file);
+        if (command == L"head")
+            printLines(pager, count);
+        else if (command == L"tail") {
+            if (count) {
+                pager.seekTail(count);
+                printLines(pager);
+            }
+        }
+        else {
+            wstring answer;
+            while (printLines(pager, pageLines) == pageLines) {
+                wcout << L"-- More (" << pager.progress() << L"%) --";
+                getline(wcin, answer);
+                if (answer == L"q")
+                    break;
+            }
+        }
+    }
+    // ls [--sort name|size|time|cluster] [--reverse] [--top n] [--limit n]
+    //    [--page p] [pattern]
+    // Sizes and times sort largest and newest first. Without a sort order
+    // the entries are streamed in directory order and only as many as shown
+    // are read.
+    void list(const wstring& commandInput) {
+        wistringstream args(commandInput);
+        wstring word, sortBy, pattern;
+        uint64_t limit = UINT64_MAX, page = 1;
+        bool reverse = false;
+        args >> word;
+        while (args >> word) {
+            if (word == L"--sort")
+                args >> sortBy;
+            else if (word == L"--reverse" || word == L"-r")
+                reverse = true;
+            else if (word == L"--top" && args >> word) {
+                limit = wcstoull(word.c_str(), 0, 10);
+                page = 1;
+                if (sortBy.empty())
+                    sortBy = L"size";
+            }
+            else if (word == L"--limit" && args >> word)
+                limit = wcstoull(word.c_str(), 0, 10);
+            else if (word == L"--page" && args >> word)
+                page = max<uint64_t>(1, wcstoull(word.c_str(), 0, 10));
+            else
+                pattern += (pattern.empty() ? L"" : L" ") + word;
+        }
+        function<bool(Entry*, Entry*)> before;
+        if (sortBy == L"name")
+            before = [](Entry* a, Entry* b) {
+                return lexicographical_compare(a->name.begin(), a->name.end(),
+                    b->name.begin(), b->name.end(), [](wchar_t x, wchar_t y) {
+                        return towlower(x) < towlower(y);
+                    });
+            };
+        else if (sortBy == L"size")
+            before = [](Entry* a, Entry* b) { return a->size > b->size; };
+        else if (sortBy == L"time")
+            before = [](Entry* a, Entry* b) {
+                return a->lastModifiedTime > b->lastModifiedTime;
+            };
+        else if (sortBy == L"cluster")
+            before = [](Entry* a, Entry* b) { return a->pos < b->pos; };
+        else if (!sortBy.empty()) {
+            wcout << L"Unknown sort order " << sortBy << L"!\n";
+            return;
+        }
+        if (before && reverse)
+            before = [before](Entry* a, Entry* b) { return before(b, a); };
+
+        uint64_t skip = limit == UINT64_MAX ? 0 : (page - 1) * limit;
+        uint64_t matched = 0, shown = 0;
+        bool more = false;
+        wstring out;
+        formatHeader(out);
+        auto show = [&](Entry* e) {
+            formatEntry(out, e);
+            shown++;
+            if (out.size() >= 1 << 16) {
+                wcout << out;
+                out.clear();
+            }
+        };
+        if (!before)
+            fs->enumerate(currentDir.top(), [&](Entry* e) {
+                if (!pattern.empty() && !Utility::glob(pattern, e->name))
+                    return true;
+                if (matched++ < skip)
+                    return true;
+                if (shown == limit) {
+                    more = true;
+                    return false;
+                }
+                show(e);
+                return true;
+            });
+        else {
+            vector<Entry*> entries;
+            fs->load(currentDir.top());
+            for (Entry* e : currentDir.top()->entries())
+                if (pattern.empty() || Utility::glob(pattern, e->name))
+                    entries.push_back(e);
+            uint64_t end = limit == UINT64_MAX ? entries.size()
+                : min<uint64_t>(entries.size(), skip + limit);
+            // Only the entries up to the end of the page need to be in order.
+            partial_sort(entries.begin(), entries.begin() + end, entries.end(),
+                before);
+            for (uint64_t i = skip; i < end; i++)
+                show(entries[i]);
+            more = end < entries.size();
+        }
+        wcout << out;
+        if (more)
+            wcout << L"-- More entries, use --page " << page + 1 << L" --\n";
+    }
+    // du [name] - usage of the current directory or of one in it, with a
+    // line for each directory in it. Totals are memoized, so asking again
+    // at any level below doesn't read anything.
+    void du(const wstring& commandInput) {
+        size_t space = commandInput.find_first_of(' ');
+        Folder* folder = currentDir.top();
+        if (space != wstring::npos) {
+            folder = dynamic_cast<Folder*>(
+                findInCurrentDir(commandInput.substr(space + 1)));
+            if (!folder) {
+                wcout << L"No such directory!\n";
+                return;
+            }
+        }
+        folder->pin();
+        const Usage total = fs->summarize(folder);
+        wstring out;
+        Utility::pad(out, L"Size", 14);
+        Utility::pad(out, L"Allocated", 14);
+        Utility::pad(out, L"Files", 10);
+        Utility::pad(out, L"Folders", 10);
+        out += L"Name\n";
+        auto line = [&](const Usage& u, const wstring& name) {
+            Utility::pad(out, to_wstring(u.size), 14);
+            Utility::pad(out, to_wstring(u.allocated), 14);
+            Utility::pad(out, to_wstring(u.files), 10);
+            Utility::pad(out, to_wstring(u.folders), 10);
+            out += name + L"\n";
+        };
+        fs->load(folder);
+        for (Entry* e : folder->entries()) {
+            Folder* sub = dynamic_cast<Folder*>(e);
+            if (sub && sub->summary() && sub->pos != folder->pos &&
+                e->name != L"..")
+                line(*sub->summary(), e->name);
+        }
+        line(total, L".");
+        folder->unpin();
+        wcout << out;
+        if (total.newest) {
+            time_t t = total.newest;
+            wchar_t text[32] = L"";
+            if (tm* local = localtime(&t))
+                wcsftime(text, 32, L"%Y-%m-%d %H:%M:%S", local);
+            wcout << L"Newest change: " << text << L"\n";
+        }
+    }
+    // owner <cluster> and owners <first>-<last>.
+    void owners(const wstring& command, const wstring& commandInput) {
+        size_t space = commandInput.find_first_of(' ');
+        if (space == wstring::npos) {
+            wcout << L"Usage: owner <cluster>, owners <first>-<last>\n";
+            return;
+        }
+        wchar_t* end;
+        uint64_t first = wcstoull(commandInput.c_str() + space + 1, &end, 10);
+        uint64_t last = first;
+        if (command == L"owners" && (*end == L'-' || *end == L' '))
+            last = max<uint64_t>(first, wcstoull(end + 1, 0, 10));
+        unique_ptr<ClusterMap>& clusters = clusterMaps[fs];
+        if (!clusters) {
+            clusters.reset(new ClusterMap);
+            clusters->build(fs);
+            if (clusters->size() == 0) {
+                clusterMaps.erase(fs);
+                wcout << L"No cluster owners on this filesystem!\n";
+                return;
+            }
+        }
+        uint64_t next = first;
+        for (const ClusterMap::Extent& e :
+            clusters->find(first, last - first + 1)) {
+            if (e.first > next)
+                wcout << L"(free), clusters " << next << L"-" << e.first - 1
+                    << L"\n";
+            wcout << clusters->describe(e) << L"\n";
+            next = max(next, e.first + e.count);
+        }
+        if (next <= last)
+            wcout << L"(free), clusters " << next << L"-" << last << L"\n";
+    }
+    // Report files with the same content on all volumes.
+    void dupes() {
+        DuplicateFinder finder(volumes);
+        finder.run();
+        const vector<DuplicateFinder::Candidate>& found = finder.duplicates();
+        uint64_t groups = 0, wasted = 0;
+        for (size_t i = 0, j; i < found.size(); i = j) {
+            for (j = i + 1; j < found.size() && found[j].size == found[i].size &&
+                found[j].hash == found[i].hash;
+                j++)
+                ;
+            wcout << found[i].size << L" bytes x " << j - i << L":\n";
+            for (size_t k = i; k < j; k++) {
+                wcout << L"  ";
+                if (volumes.size() > 1)
+                    wcout << found[k].volume << L":";
+                wcout << finder.path(found[k]) << L"\n";
+            }
+            groups++;
+            wasted += found[i].size * (j - i - 1);
+        }
+        wcout << groups << L" groups of duplicates, " << wasted
+            << L" bytes wasted\n";
+        wcout << finder.files << L" files, " << finder.partiallyRead
+            << L" with first and last block read, " << finder.fullyRead
+            << L" read in full\n";
+    }
+    // timeline [csv|body] <output file>
+    void timeline(const wstring& commandInput) {
+        size_t space = commandInput.find_first_of(' ');
+        wstring argument =
+            space == wstring::npos ? L"" : commandInput.substr(space + 1);
+        bool body = false;
+        if (argument.compare(0, 5, L"body ") == 0 ||
+            argument.compare(0, 4, L"csv ") == 0) {
+            body = argument[0] == L'b';
+            argument.erase(0, argument.find_first_of(' ') + 1);
+        }
+        if (argument.empty()) {
+            wcout << L"Usage: timeline [csv|body] <output file>\n";
+            return;
+        }
+#ifdef _WIN32
+        FILE* out = _wfopen(argument.c_str(), L"wb");
+#else
+        FILE* out = fopen(Utility::toUTF8(argument).c_str(), "wb");
+#endif
+        if (!out) {
+            wcout << L"Can't write " << argument << L"!\n";
+            return;
+        }
+        Timeline timeline(out);
+        uint64_t count =
+            body ? timeline.writeBodyfile(fs) : timeline.writeCSV(fs);
+        fclose(out);
+        wcout << count << (body ? L" records" : L" events") << L" written to "
+            << argument << L"\n";
+    }
+    void mountAll(wstring diskPath) {
+        shared_ptr<Disk> disk = make_shared<Disk>(diskPath, directIO);
+        if (!disk->isOpen()) {
+            wcout << L"reading failed\n";
+            wcout << L"Error opening the file: " << strerror(disk->error())
+                << endl;
+            return;
+        }
+        for (Volume& v : Volumes::mountAll(disk, diskPath)) {
+            volumes.push_back(v.fs);
+            volumeNames.push_back(v.name);
+        }
+    }
+    // All volumes of the session share one content cache and its budget.
+    void shareCache() {
+        shared_ptr<ContentCache> shared =
+            make_shared<ContentCache>(cacheBudget);
+        for (Filesystem* v : volumes)
+            v->shareCache(shared);
+    }
+    void selectVolume(size_t indx) {
+        while (!currentDir.empty())
+            leaveDir();
+        currentVolume = indx;
+        fs = volumes[indx];
+        enterDir(fs->rootDirectory);
+    }
+
+public:
+    CMD(bool directIO = false, uint64_t cacheBudget = 256 << 20)
+        : fs(0), currentVolume(0), directIO(directIO),
+        cacheBudget(cacheBudget) {}
+    ~CMD() {
+        for (Filesystem* v : volumes)
+            delete v;
+    }
+    void run() {
+        wcout << L"Input disk: ";
+        getline(wcin, diskPath);
+#ifdef _WIN32
+        if (diskPath.compare(0, 13, L"PhysicalDrive") == 0)
+            diskPath = L"\\\\.\\" + diskPath; // whole disk
+        else
+            diskPath = L"\\\\.\\" + diskPath + L":";
+#else
+        diskPath = L"/dev/" + diskPath;
+#endif
+        mountAll(diskPath);
+        if (volumes.empty()) {
+            wcout << L"Not supported filesystem!\n";
+            return;
+        }
+        shareCache();
+        selectVolume(0);
+        wstring commandInput;
+        while (1) {
+            if (volumes.size() > 1)
+                wcout << currentVolume << L":";
+            printCurrentDir(currentDir);
+            getline(wcin, commandInput);
+            wstring command =
+                commandInput.substr(0, commandInput.find_first_of(' '));
+            if (command == L"dir" || command == L"ls")
+                list(commandInput);
+            else if (command == L"info")
+                printInfo();
+            else if (command == L"cls" || command == L"clear")
+                system("clear || cls");
+            else if (command == L"exit")
+                return;
+            else if (command == L"head" || command == L"tail" ||
+                command == L"less")
+                page(command, commandInput);
+            else if (command == L"owner" || command == L"owners")
+                owners(command, commandInput);
+            else if (command == L"dupes")
+                dupes();
+            else if (command == L"du")
+                du(commandInput);
+            else if (command == L"timeline")
+                timeline(commandInput);
+            else if (command == L"cache") {
+                ContentCache& cache = fs->getCache();
+                size_t space = commandInput.find_first_of(' ');
+                if (space != wstring::npos)
+                    cache.setBudget(
+                        wcstoull(commandInput.c_str() + space + 1, 0, 10)
+                        << 20);
+                wcout << L"Cache: " << cache.size() << L" items, "
+                    << (cache.getUsed() >> 10) << L" of "
+                    << (cache.getBudget() >> 10) << L" KiB used\n";
+            }
+            else if (command == L"vol") {
+                size_t space = commandInput.find_first_of(' ');
+                if (space == wstring::npos) {
+                    for (size_t i = 0; i < volumes.size(); i++)
+                        wcout << (i == currentVolume ? L"* " : L"  ") << i
+                            << L" " << volumeNames[i] << L"\n";
+                }
+                else {
+                    size_t indx = wcstoul(commandInput.c_str() + space + 1,
+                        0, 10);
+                    if (indx < volumes.size())
+                        selectVolume(indx);
+                    else
+                        wcout << L"No such volume!\n";
+                }
+            }
+            else if (command == L"refresh") {
+                vector<wstring> path = leaveCurrentDir();
+                int changed = fs->refresh();
+                clusterMaps.erase(fs);
+                restoreCurrentDir(path);
+                if (changed < 0)
+                    wcout << L"Refresh is not supported on this filesystem!\n";
+                else {
+                    wcout << changed << L" directories re-read\n";
+                }
+            }
+            else if (command == L"open" || command == L"cd") {
+                wstring argument =
+                    commandInput.substr(commandInput.find_first_of(' ') + 1);
+
+                if (argument == L".")
+                    continue;
+                else if (argument == L"..") {
+                    if (currentDir.size() > 1)
+                        leaveDir();
+                }
+                else {
+                    Entry* found = findInCurrentDir(
+                        wstring(argument.begin(), argument.end()));
+                    if (found && command == L"open" && dynamic_cast<TXT*>(found)) {
+                        TextPager pager = openText(found);
+                        printLines(pager);
+                    }
+                    else if (found && command == L"cd") {
+                        if (dynamic_cast<Folder*>(found))
+                            enterDir(dynamic_cast<Folder*>(found));
+                        else
+                            wcout << L"Can't change directory to a file!\n";
+                    }
+                    else if (found) {
+                        fs->load(found);
+                        if (dynamic_cast<Folder*>(found))
+                            printFolder(dynamic_cast<Folder*>(found));
+                        else
+                            wcout << L"Can't open directly! Please use another program.\n";
+                    }
+                    else
+                        wcout << L"Doesn't found!\n";
+                }
+            }
+            else if (command == L"help")
+                showHelp();
+            else
+                wcout << L"Wrong command! Type help for more info.\n";
+        }
+    }
+    void showHelp() {
+        wcout << L"dir/ls - print content of current directory\n";
+        wcout << L"    [--sort name|size|time|cluster] [--reverse] [--top n]\n";
+        wcout << L"    [--limit n] [--page p] [pattern with * and ?]\n";
+        wcout << L"open - open file\n";
+        wcout << L"cd - open directory\n";
+        wcout << L"head/tail [n] <file> - print the first or last n lines\n";
+        wcout << L"less <file> - page through a text file\n";
+        wcout << L"info - print info about filesystem\n";
+        wcout << L"refresh - re-read directories changed on disk\n";
+        wcout << L"vol [n] - list volumes of the disk or switch to one\n";
+        wcout << L"cache [MB] - show the content cache or set its budget\n";
+        wcout << L"timeline [csv|body] <file> - write a MAC timeline of the volume\n";
+        wcout << L"dupes - list files with the same content on all volumes\n";
+        wcout << L"du [directory] - total size and count of files below a directory\n";
+        wcout << L"owner <cluster> - show which file owns a cluster\n";
+        wcout << L"owners <first>-<last> - show the owners of a range of clusters\n";
+        wcout << L"cls/clear - clear screen\n";
+        wcout << L"exit - exit program\n";
+    }
+};
+
+int main(int argc, char* argv[]) {
+    bool directIO = false;
+    uint64_t cacheBudget = 256 << 20;
+    uint32_t chunkSize = CompressedImage::defaultChunkSize;
+    const char *compressFrom = 0, *compressTo = 0;
+    for (int i = 1; i < argc; i++)
+        if (strcmp(argv[i], "--direct") == 0)
+            directIO = true;
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+            cacheBudget = strtoull(argv[++i], 0, 10) << 20;
+        else if (strcmp(argv[i], "--compress") == 0 && i + 2 < argc) {
+            compressFrom = argv[++i];
+            compressTo = argv[++i];
+        }
+        else if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc)
+            chunkSize = strtoul(argv[++i], 0, 10) << 10;
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_U16TEXT);
+    _setmode(_fileno(stdin), _O_U16TEXT);
+#else
+    locale::global(locale("en_US.UTF-8"));
+    wcout.imbue(locale());
+    wcin.imbue(locale());
+#endif
+    if (compressFrom) {
+        if (!chunkSize ||
+            !CompressedImage::convert(compressFrom, compressTo, chunkSize)) {
+            wcout << L"Compressing the image failed\n";
+            return 1;
+        }
+        return 0;
+    }
+    CMD cmd(directIO, cacheBudget);
+    cmd.run();
+}
+
@@ -0,0 +1,3992 @@
+// FAT32 and NTFS reading library, header only. Everything is in namespace
+// fsread.
+//
+// Volumes::mountAll opens a disk, an image or a compressed image and
+// returns a Filesystem for each supported volume on it. From there:
+//  - enumerate(folder, visit) streams the entries of a directory through a
+//    callback, the Entry passed is only valid during the call and may be
+//    reused for the next one;
+//  - load(folder) reads a directory into the tree (rootDirectory and the
+//    Folder objects below it), bounded by the shared ContentCache budget;
+//  - readFile(entry, offset, buffer, size) reads any range of a file into
+//    a buffer of the caller;
+//  - summarize, collectTimes and collectExtents walk the whole volume.
+// Nothing here prints. A Filesystem is meant to be used from one thread at
+// a time, except readFile, which may be called from several at once.
+#pragma once
+
+#include <fcntl.h>
+#ifdef _WIN32
+#include <IO.h>
+#include <Windows.h>
+#else
+#include <unistd.h>
+#endif
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+// Compressed images need zlib: build with -DHAVE_ZLIB and link it.
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "zlib")
+#endif
+#endif
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <condition_variable>
+#include <ctime>
+#include <cwctype>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace fsread {
+
+class Utility {
+public:
+    static void trim(std::wstring& string) {
+        int i = string.size() - 1;
+        for (; i >= 0 &&
+            (string[i] == L' ' || string[i] == 0 || string[i] == 0xFFFF);
+            i--)
+            string.pop_back();
+    }
+    static bool endsWith(const std::wstring& fullString,
+        const std::wstring& ending) {
+        if (fullString.length() >= ending.length()) {
+            return (fullString.compare(fullString.length() - ending.length(), ending.length(), ending) == 0);
+        }
+        else {
+            return false;
+        }
+    }
+    // Append text left aligned in a field of width characters.
+    static void pad(std::wstring& out, const std::wstring& text, size_t width) {
+        out += text;
+        if (text.size() < width)
+            out.append(width - text.size(), L' ');
+    }
+    // Case-insensitive match against a pattern with * and ?.
+    static bool glob(const std::wstring& pattern, const std::wstring& text) {
+        size_t p = 0, t = 0, star = std::wstring::npos, resume = 0;
+        while (t < text.size()) {
+            if (p < pattern.size() && (pattern[p] == L'?' ||
+                towlower(pattern[p]) == towlower(text[t]))) {
+                p++;
+                t++;
+            }
+            else if (p < pattern.size() && pattern[p] == L'*') {
+                star = p++;
+                resume = t;
+            }
+            else if (star != std::wstring::npos) {
+                p = star + 1;
+                t = ++resume;
+            }
+            else
+                return false;
+        }
+        while (p < pattern.size() && pattern[p] == L'*')
+            p++;
+        return p == pattern.size();
+    }
+    static std::string toUTF8(const std::wstring& text) {
+        std::string rt;
+        for (size_t i = 0; i < text.size(); i++) {
+            uint32_t cp = text[i];
+            if (cp >= 0xD800 && cp < 0xDC00 && i + 1 < text.size() &&
+                text[i + 1] >= 0xDC00 && text[i + 1] <= 0xDFFF)
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (text[++i] - 0xDC00);
+            if (cp < 0x80)
+                rt.push_back(char(cp));
+            else if (cp < 0x800) {
+                rt.push_back(char(0xC0 | cp >> 6));
+                rt.push_back(char(0x80 | (cp & 0x3F)));
+            }
+            else if (cp < 0x10000) {
+                rt.push_back(char(0xE0 | cp >> 12));
+                rt.push_back(char(0x80 | ((cp >> 6) & 0x3F)));
+                rt.push_back(char(0x80 | (cp & 0x3F)));
+            }
+            else {
+                rt.push_back(char(0xF0 | cp >> 18));
+                rt.push_back(char(0x80 | ((cp >> 12) & 0x3F)));
+                rt.push_back(char(0x80 | ((cp >> 6) & 0x3F)));
+                rt.push_back(char(0x80 | (cp & 0x3F)));
+            }
+        }
+        return rt;
+    }
+};
+
+class Entry {
+public:
+    union {
+        struct {
+            bool readOnly : 1;
+            bool hidden : 1;
+            bool system : 1;
+            bool volume : 1;
+            bool directory : 1;
+            bool archive : 1;
+            bool device : 1;
+            bool normal : 1;
+        };
+        int32_t data;
+    } attribute;
+    std::wstring name, extension;
+    uint64_t pos, parentPos;
+    uint64_t size;
+    uint64_t allocatedSize; // as recorded in the metadata, 0 if unknown
+    time_t lastModifiedTime;
+    // 0 where the filesystem doesn't keep the time.
+    time_t creationTime, lastAccessTime, mftChangeTime;
+    Entry()
+        : allocatedSize(0), lastModifiedTime(0), creationTime(0),
+        lastAccessTime(0), mftChangeTime(0) {}
+    virtual ~Entry() {}
+    virtual const wchar_t* typeName() = 0;
+};
+
+// Totals over everything below a directory.
+struct Usage {
+    uint64_t size, allocated, files, folders;
+    time_t newest;
+    void add(const Usage& o) {
+        size += o.size;
+        allocated += o.allocated;
+        files += o.files;
+        folders += o.folders;
+        newest = std::max(newest, o.newest);
+    }
+};
+class Folder : public Entry {
+protected:
+    std::vector<Entry*> subEntries;
+    bool loaded;
+    int pins; // directories on the current path can't be unloaded
+    // Usage of the whole subtree, kept when the folder is unloaded and
+    // dropped when the subtree is re-read after a change.
+    Usage usage;
+    bool summarized;
+
+public:
+    Folder() : loaded(false), pins(0), summarized(false) {}
+    ~Folder() {
+        for (Entry* e : subEntries)
+            delete e;
+    }
+    Entry* find(std::wstring _name) {
+        for (Entry* entry : subEntries)
+            if (entry->name.compare(_name) == 0)
+                return entry;
+        return 0;
+    }
+    // The entries read so far, empty until the folder is loaded.
+    const std::vector<Entry*>& entries() { return subEntries; }
+    bool isLoaded() { return loaded; }
+    // A pinned folder stays loaded whatever the cache budget.
+    void pin() { pins++; }
+    void unpin() { pins--; }
+    // The memoized usage of the subtree, 0 if it isn't known.
+    const Usage* summary() { return summarized ? &usage : 0; }
+    const wchar_t* typeName() { return L"Folder"; }
+    friend class FAT32;
+    friend class NTFS;
+    friend class Filesystem;
+    friend class ContentCache;
+};
+class File : public Entry {
+protected:
+    void* dataPtr;
+
+public:
+    File() : dataPtr(0) {}
+    virtual ~File() { free(dataPtr); }
+    const wchar_t* typeName() { return L"File"; }
+    friend class FAT32;
+    friend class NTFS;
+    friend class ContentCache;
+};
+
+// Incremental text decoder for UTF-8 and UTF-16. Input can be fed in chunks
+// of any size: a sequence split between two chunks is carried over to the
+// next call. Invalid input decodes to U+FFFD.
+class TextDecoder {
+public:
+    enum Encoding { UTF8, UTF16LE, UTF16BE };
+
+private:
+    Encoding encoding;
+    uint8_t carry[4];
+    size_t carrySize;
+
+    static void put(std::wstring& out, uint32_t cp) {
+        if (sizeof(wchar_t) == 2 && cp >= 0x10000) {
+            cp -= 0x10000;
+            out.push_back(wchar_t(0xD800 + (cp >> 10)));
+            out.push_back(wchar_t(0xDC00 + (cp & 0x3FF)));
+        }
+        else
+            out.push_back(wchar_t(cp));
+    }
+    // Decode as far as complete sequences go, returns where it stopped.
+    const uint8_t* decodeUTF8(const uint8_t* p, const uint8_t* end,
+        std::wstring& out) {
+        while (p < end) {
+#ifdef HAVE_SSE2
+            // 16 ASCII bytes at a time: no high bit set, widen them as is.
+            if (end - p >= 16) {
+                __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+                if (_mm_movemask_epi8(bytes) == 0) {
+                    size_t at = out.size();
+                    out.resize(at + 16);
+                    __m128i zero = _mm_setzero_si128();
+                    __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+                    __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+                    __m128i* dst = (__m128i*)&out[at];
+                    if (sizeof(wchar_t) == 2) {
+                        _mm_storeu_si128(dst, lo);
+                        _mm_storeu_si128(dst + 1, hi);
+                    }
+                    else {
+                        _mm_storeu_si128(dst, _mm_unpacklo_epi16(lo, zero));
+                        _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(lo, zero));
+                        _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(hi, zero));
+                        _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(hi, zero));
+                    }
+                    p += 16;
+                    continue;
+                }
+            }
+#endif
+            uint8_t c = *p;
+            if (c < 0x80) {
+                out.push_back(c);
+                p++;
+                continue;
+            }
+            int length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC2 ? 2 : 0;
+            if (length == 0 || c > 0xF4) {
+                put(out, 0xFFFD);
+                p++;
+                continue;
+            }
+            if (end - p < length)
+                return p;
+            uint32_t cp = c & (0x7F >> length);
+            bool valid = true;
+            for (int i = 1; i < length; i++) {
+                valid &= (p[i] & 0xC0) == 0x80;
+                cp = (cp << 6) | (p[i] & 0x3F);
+            }
+            if (!valid || (length == 3 && cp < 0x800) ||
+                (length == 4 && (cp < 0x10000 || cp > 0x10FFFF)) ||
+                (cp >= 0xD800 && cp <= 0xDFFF)) {
+                put(out, 0xFFFD);
+                p++;
+                continue;
+            }
+            put(out, cp);
+            p += length;
+        }
+        return p;
+    }
+    const uint8_t* decodeUTF16(const uint8_t* p, const uint8_t* end,
+        std::wstring& out) {
+        bool big = encoding == UTF16BE;
+        auto unit = [big](const uint8_t* q) {
+            return big ? uint32_t(q[0] << 8 | q[1]) : uint32_t(q[1] << 8 | q[0]);
+        };
+        while (end - p >= 2) {
+            uint32_t u = unit(p);
+            if (u < 0xD800 || u > 0xDFFF) {
+                out.push_back(wchar_t(u));
+                p += 2;
+                continue;
+            }
+            if (u < 0xDC00) {
+                if (end - p < 4)
+                    return p;
+                uint32_t low = unit(p + 2);
+                if (low >= 0xDC00 && low <= 0xDFFF) {
+                    put(out, 0x10000 + ((u - 0xD800) << 10) + (low - 0xDC00));
+                    p += 4;
+                    continue;
+                }
+            }
+            put(out, 0xFFFD);
+            p += 2;
+        }
+        return p;
+    }
+    const uint8_t* decodeRun(const uint8_t* p, const uint8_t* end,
+        std::wstring& out) {
+        return encoding == UTF8 ? decodeUTF8(p, end, out)
+            : decodeUTF16(p, end, out);
+    }
+
+public:
+    TextDecoder(Encoding encoding = UTF8) : encoding(encoding), carrySize(0) {}
+    // Tell the encoding from a byte order mark, UTF-8 if there is none.
+    static Encoding detect(const char* data, uint64_t size, uint64_t& bomSize) {
+        const uint8_t* p = (const uint8_t*)data;
+        if (size >= 3 && p[0] == 0xEF && p[1] == 0xBB && p[2] == 0xBF) {
+            bomSize = 3;
+            return UTF8;
+        }
+        bomSize = 2;
+        if (size >= 2 && p[0] == 0xFF && p[1] == 0xFE)
+            return UTF16LE;
+        if (size >= 2 && p[0] == 0xFE && p[1] == 0xFF)
+            return UTF16BE;
+        bomSize = 0;
+        return UTF8;
+    }
+    Encoding getEncoding() { return encoding; }
+    void reset() { carrySize = 0; }
+    void decode(const char* data, size_t size, std::wstring& out) {
+        const uint8_t *p = (const uint8_t*)data, *end = p + size;
+        if (carrySize) {
+            // Finish the sequence left over from the last chunk.
+            uint8_t joined[8];
+            size_t take = std::min(size, sizeof(joined) - carrySize);
+            memcpy(joined, carry, carrySize);
+            memcpy(joined + carrySize, p, take);
+            size_t used =
+                decodeRun(joined, joined + carrySize + take, out) - joined;
+            if (used < carrySize) {
+                carrySize += take - used;
+                memmove(carry, joined + used, carrySize);
+                return;
+            }
+            p += used - carrySize;
+            carrySize = 0;
+        }
+        const uint8_t* stop = decodeRun(p, end, out);
+        carrySize = end - stop;
+        memcpy(carry, stop, carrySize);
+    }
+    // End of input: a sequence still open is incomplete.
+    void finish(std::wstring& out) {
+        if (carrySize)
+            put(out, 0xFFFD);
+        carrySize = 0;
+    }
+};
+
+// Pages through a text file read on demand a chunk at a time, so memory use
+// doesn't grow with the file. Lines longer than a chunk are split.
+class TextPager {
+public:
+    typedef std::function<uint64_t(uint64_t, char*, uint64_t)> Reader;
+    static constexpr uint64_t chunkSize = 64 << 10;
+
+private:
+    Reader read;
+    uint64_t size, bomSize, offset;
+    TextDecoder decoder;
+    std::vector<char> chunk;
+    std::wstring text;
+    size_t textPos;
+
+    bool fill() {
+        if (offset >= size)
+            return false;
+        uint64_t got = read(offset, chunk.data(), std::min(chunkSize, size - offset));
+        if (got == 0) {
+            offset = size;
+            return false;
+        }
+        offset += got;
+        text.erase(0, textPos);
+        textPos = 0;
+        decoder.decode(chunk.data(), got, text);
+        if (offset >= size)
+            decoder.finish(text);
+        return true;
+    }
+    bool isNewline(const char* p) {
+        switch (decoder.getEncoding()) {
+        case TextDecoder::UTF16LE:
+            return p[0] == '\n' && p[1] == 0;
+        case TextDecoder::UTF16BE:
+            return p[0] == 0 && p[1] == '\n';
+        default:
+            return *p == '\n';
+        }
+    }
+
+public:
+    TextPager(Reader read, uint64_t size)
+        : read(read), size(size), bomSize(0), offset(0), chunk(chunkSize),
+        textPos(0) {
+        char head[4];
+        uint64_t got = size ? read(0, head, std::min<uint64_t>(4, size)) : 0;
+        decoder = TextDecoder(TextDecoder::detect(head, got, bomSize));
+        offset = bomSize;
+    }
+    // Continue decoding at a byte offset, which must start a line.
+    void seek(uint64_t to) {
+        offset = std::max(to, bomSize);
+        decoder.reset();
+        text.clear();
+        textPos = 0;
+    }
+    // Percentage of the file read so far.
+    int progress() { return size ? int(offset * 100 / size) : 100; }
+    bool nextLine(std::wstring& line) {
+        while (1) {
+            size_t newline = text.find(L'\n', textPos);
+            if (newline != std::wstring::npos) {
+                line.assign(text, textPos, newline - textPos);
+                textPos = newline + 1;
+                break;
+            }
+            if (text.size() - textPos >= chunkSize || !fill()) {
+                if (textPos == text.size())
+                    return false;
+                line.assign(text, textPos, chunkSize);
+                textPos += line.size();
+                break;
+            }
+        }
+        if (!line.empty() && line.back() == L'\r')
+            line.pop_back();
+        return true;
+    }
+    // Seek to the start of the last count lines, scanning backwards from the
+    // end of the file so only the tail of it is read.
+    void seekTail(uint64_t count) {
+        uint64_t unit = decoder.getEncoding() == TextDecoder::UTF8 ? 1 : 2;
+        uint64_t end = size - (size - bomSize) % unit, start = bomSize;
+        uint64_t newlines = 0;
+        for (uint64_t pos = end; pos > bomSize && newlines < count;) {
+            uint64_t from = pos - std::min(chunkSize, pos - bomSize);
+            from += (from - bomSize) % unit; // keep UTF-16 units aligned
+            uint64_t got = read(from, chunk.data(), pos - from);
+            if (got != pos - from)
+                break;
+            for (uint64_t i = got; i >= unit && newlines < count; i -= unit) {
+                if (!isNewline(&chunk[i - unit]))
+                    continue;
+                // A newline ending the file doesn't start another line.
+                if (from + i == end)
+                    continue;
+                if (++newlines == count)
+                    start = from + i;
+            }
+            pos = from;
+        }
+        seek(start);
+    }
+};
+
+class TXT : public File {
+public:
+    const wchar_t* typeName() { return L"TXT"; }
+};
+
+// Tracks the access pattern of disk reads. A read starting where the last
+// one ended is a sequential hit and doubles the read-ahead window, anything
+// else halves it, so random access stops prefetching quickly.
+class ReadAhead {
+    uint64_t nextPos, prefetchedEnd, window;
+
+public:
+    static constexpr uint64_t minWindow = 64 * 1024;
+    static constexpr uint64_t maxWindow = 8 * 1024 * 1024;
+    ReadAhead() : nextPos(0), prefetchedEnd(0), window(minWindow) {}
+    // Returns the range worth prefetching after this read ({0, 0} if none).
+    std::pair<uint64_t, uint64_t> access(uint64_t pos, uint64_t size) {
+        bool hit = pos == nextPos;
+        nextPos = pos + size;
+        if (!hit) {
+            window = std::max(window / 2, minWindow);
+            prefetchedEnd = nextPos;
+            return { 0, 0 };
+        }
+        window = std::min(window * 2, maxWindow);
+        // Only advise again once half of the prefetched data was consumed.
+        if (nextPos + window / 2 <= prefetchedEnd)
+            return { 0, 0 };
+        uint64_t start = std::max(prefetchedEnd, nextPos);
+        prefetchedEnd = nextPos + window;
+        return { start, prefetchedEnd - start };
+    }
+};
+
+// Fixed set of worker threads running queued jobs in FIFO order.
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> jobs;
+    std::mutex lock;
+    std::condition_variable ready;
+    bool stopping;
+
+    void work() {
+        while (1) {
+            std::unique_lock<std::mutex> l(lock);
+            ready.wait(l, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            std::function<void()> job = std::move(jobs.front());
+            jobs.pop();
+            l.unlock();
+            job();
+        }
+    }
+
+public:
+    ThreadPool(unsigned threads = std::thread::hardware_concurrency())
+        : stopping(false) {
+        if (threads == 0)
+            threads = 4;
+        for (unsigned i = 0; i < threads; i++)
+            workers.emplace_back([this] { work(); });
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (std::thread& t : workers)
+            t.join();
+    }
+    size_t size() { return workers.size(); }
+    void post(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            jobs.push(std::move(job));
+        }
+        ready.notify_one();
+    }
+};
+
+struct ReadRequest {
+    void* buffer;
+    uint64_t pos, size;
+    bool ok;
+};
+
+#ifdef HAVE_IO_URING
+// Minimal io_uring wrapper over the raw syscalls: one submission and one
+// completion ring, used for plain reads only.
+class IoUring {
+    int ringFd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray, sqEntries;
+    unsigned *cqHead, *cqTail, *cqMask;
+    void *sqRing, *cqRing;
+    io_uring_sqe* sqes;
+    io_uring_cqe* cqes;
+    size_t sqRingSize, cqRingSize, sqesSize;
+
+public:
+    IoUring() : ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED),
+        sqes((io_uring_sqe*)MAP_FAILED) {}
+    ~IoUring() {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (ringFd >= 0)
+            close(ringFd);
+    }
+    bool init(unsigned depth) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ringFd = syscall(__NR_io_uring_setup, depth, &p);
+        if (ringFd < 0)
+            return false;
+        sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        sqRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+            return false;
+        cqRing = single ? sqRing
+            : mmap(0, cqRingSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED)
+            return false;
+        sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(0, sqesSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+        char* sq = (char*)sqRing;
+        char* cq = (char*)cqRing;
+        sqHead = (unsigned*)(sq + p.sq_off.head);
+        sqTail = (unsigned*)(sq + p.sq_off.tail);
+        sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+        sqArray = (unsigned*)(sq + p.sq_off.array);
+        sqEntries = p.sq_entries;
+        cqHead = (unsigned*)(cq + p.cq_off.head);
+        cqTail = (unsigned*)(cq + p.cq_off.tail);
+        cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        return supportsRead();
+    }
+    // IORING_OP_READ came with Linux 5.6, like probing. Older kernels set
+    // the ring up fine but fail every read, so the ring isn't used there.
+    bool supportsRead() {
+        const unsigned ops = 256;
+        std::vector<char> buffer(
+            sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op));
+        io_uring_probe* probe = (io_uring_probe*)buffer.data();
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE,
+            probe, ops) < 0)
+            return false;
+        return probe->last_op >= IORING_OP_READ &&
+            (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    }
+    bool push(int fd, void* buffer, uint32_t size, uint64_t pos,
+        uint64_t userData) {
+        unsigned tail = *sqTail;
+        if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+            return false;
+        unsigned indx = tail & *sqMask;
+        io_uring_sqe* sqe = &sqes[indx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)buffer;
+        sqe->len = size;
+        sqe->off = pos;
+        sqe->user_data = userData;
+        sqArray[indx] = indx;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    int enter(unsigned toSubmit, unsigned minComplete) {
+        return syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+    bool pop(uint64_t& userData, int& result) {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            return false;
+        io_uring_cqe* cqe = &cqes[head & *cqMask];
+        userData = cqe->user_data;
+        result = cqe->res;
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+#endif
+
+// Runs batches of reads with many requests in flight. Uses io_uring where
+// the kernel supports it and a pool of threads doing positional reads
+// otherwise. Completions are reported in the order they finish.
+class AsyncReader {
+    std::function<int64_t(void*, uint64_t, uint64_t)> rawRead;
+    unsigned depth;
+    ThreadPool* pool;
+#ifdef HAVE_IO_URING
+    int fd;
+    IoUring* ring;
+
+    void runRing(std::vector<ReadRequest>& batch,
+        const std::function<void(ReadRequest&)>& done) {
+        size_t next = 0, inFlight = 0, completed = 0;
+        std::vector<bool> finished(batch.size());
+        while (completed < batch.size()) {
+            unsigned queued = 0;
+            while (next < batch.size() && inFlight < depth &&
+                ring->push(fd, batch[next].buffer, batch[next].size,
+                    batch[next].pos, next)) {
+                next++, inFlight++, queued++;
+            }
+            if (ring->enter(queued, 1) < 0 && errno != EINTR) {
+                // The ring is unusable, finish the rest synchronously.
+                delete ring;
+                ring = 0;
+                for (size_t i = 0; i < batch.size(); i++)
+                    if (!finished[i]) {
+                        batch[i].ok =
+                            rawRead(batch[i].buffer, batch[i].pos,
+                                batch[i].size) > 0;
+                        if (done)
+                            done(batch[i]);
+                    }
+                return;
+            }
+            uint64_t indx;
+            int result;
+            while (ring->pop(indx, result)) {
+                inFlight--, completed++;
+                finished[indx] = true;
+                batch[indx].ok = result > 0;
+                if (done)
+                    done(batch[indx]);
+            }
+        }
+    }
+#endif
+
+    void runPool(std::vector<ReadRequest>& batch,
+        const std::function<void(ReadRequest&)>& done) {
+        if (!pool)
+            pool = new ThreadPool(std::min(depth, 16u));
+        std::mutex m;
+        std::condition_variable cv;
+        std::queue<size_t> completed;
+        for (size_t i = 0; i < batch.size(); i++)
+            pool->post([&, i] {
+                ReadRequest& r = batch[i];
+                r.ok = rawRead(r.buffer, r.pos, r.size) > 0;
+                std::lock_guard<std::mutex> l(m);
+                completed.push(i);
+                cv.notify_one();
+            });
+        for (size_t n = 0; n < batch.size(); n++) {
+            std::unique_lock<std::mutex> l(m);
+            cv.wait(l, [&] { return !completed.empty(); });
+            size_t i = completed.front();
+            completed.pop();
+            l.unlock();
+            if (done)
+                done(batch[i]);
+        }
+    }
+
+public:
+    AsyncReader(std::function<int64_t(void*, uint64_t, uint64_t)> rawRead,
+        int fd = -1, unsigned depth = 64)
+        : rawRead(rawRead), depth(depth), pool(0) {
+#ifdef HAVE_IO_URING
+        this->fd = fd;
+        ring = new IoUring;
+        if (fd < 0 || !ring->init(depth)) {
+            delete ring;
+            ring = 0;
+        }
+#endif
+    }
+    ~AsyncReader() {
+#ifdef HAVE_IO_URING
+        delete ring;
+#endif
+        delete pool;
+    }
+    void run(std::vector<ReadRequest>& batch,
+        const std::function<void(ReadRequest&)>& done) {
+#ifdef HAVE_IO_URING
+        if (ring) {
+            runRing(batch, done);
+            return;
+        }
+#endif
+        runPool(batch, done);
+    }
+};
+
+// Sector-aligned buffers for unbuffered (direct) I/O. Buffers are handed
+// back after every read and reused, so direct reads don't allocate.
+class AlignedBufferPool {
+    std::vector<char*> buffers;
+
+public:
+    static constexpr size_t alignment = 4096;
+    static constexpr size_t bufferSize = 1024 * 1024;
+    ~AlignedBufferPool() {
+        for (char* b : buffers)
+#ifdef _WIN32
+            _aligned_free(b);
+#else
+            free(b);
+#endif
+    }
+    char* acquire() {
+        if (buffers.empty()) {
+#ifdef _WIN32
+            return (char*)_aligned_malloc(bufferSize, alignment);
+#else
+            void* b = 0;
+            if (posix_memalign(&b, alignment, bufferSize))
+                return 0;
+            return (char*)b;
+#endif
+        }
+        char* b = buffers.back();
+        buffers.pop_back();
+        return b;
+    }
+    void release(char* b) { buffers.push_back(b); }
+};
+
+// Seekable compressed image. The image is cut into fixed-size chunks that
+// are deflated independently, so any byte is reached by inflating a single
+// chunk. Layout, little endian:
+//   "FSRZIMG1", uint32 chunk size, uint32 flags (0), uint64 image size,
+//   uint64 offset of the chunk table, the chunks, then the chunk table:
+//   uint64 file offset of every chunk plus one for the end of the last.
+// A chunk stored with its full size is kept uncompressed.
+class CompressedImage {
+public:
+    typedef std::function<int64_t(void*, uint64_t, uint64_t)> Reader;
+    static constexpr char magic[9] = "FSRZIMG1";
+    static constexpr uint32_t headerSize = 32;
+    static constexpr uint32_t defaultChunkSize = 256 * 1024;
+    static constexpr uint32_t maxChunkSize = 64 * 1024 * 1024;
+
+private:
+    typedef std::shared_ptr<std::vector<char>> Chunk;
+    Reader fileRead;
+    uint32_t chunkSize;
+    uint64_t imageSize;
+    std::vector<uint64_t> offsets;
+
+    // Inflated chunks, least recently used dropped first. Chunks being
+    // inflated are in pending so nobody inflates them twice.
+    std::unordered_map<uint64_t,
+        std::pair<Chunk, std::list<uint64_t>::iterator>> cache;
+    std::list<uint64_t> cacheOrder;
+    std::set<uint64_t> pending;
+    std::mutex cacheLock;
+    std::condition_variable inflated;
+    size_t cacheChunks;
+    ThreadPool* prefetcher;
+
+    uint64_t chunkCount() { return offsets.size() - 1; }
+    uint64_t rawSize(uint64_t i) {
+        return std::min<uint64_t>(chunkSize, imageSize - i * chunkSize);
+    }
+    Chunk inflateChunk(uint64_t i) {
+        uint64_t stored = offsets[i + 1] - offsets[i];
+        uint64_t size = rawSize(i);
+        Chunk chunk = std::make_shared<std::vector<char>>(size);
+        if (stored == size)
+            return fileRead(chunk->data(), offsets[i], size) == (int64_t)size
+                ? chunk : nullptr;
+        std::vector<char> compressed(stored);
+        if (fileRead(compressed.data(), offsets[i], stored) != (int64_t)stored)
+            return nullptr;
+#ifdef HAVE_ZLIB
+        uLongf length = size;
+        if (uncompress((Bytef*)chunk->data(), &length,
+            (const Bytef*)compressed.data(), stored) == Z_OK &&
+            length == size)
+            return chunk;
+#endif
+        return nullptr;
+    }
+    // Called with cacheLock held.
+    void store(uint64_t i, Chunk chunk) {
+        pending.erase(i);
+        if (!chunk || cache.count(i))
+            return;
+        cacheOrder.push_front(i);
+        cache[i] = { chunk, cacheOrder.begin() };
+        while (cache.size() > cacheChunks) {
+            cache.erase(cacheOrder.back());
+            cacheOrder.pop_back();
+        }
+    }
+    Chunk get(uint64_t i) {
+        std::unique_lock<std::mutex> l(cacheLock);
+        while (1) {
+            auto it = cache.find(i);
+            if (it != cache.end()) {
+                cacheOrder.splice(cacheOrder.begin(), cacheOrder,
+                    it->second.second);
+                return it->second.first;
+            }
+            if (!pending.count(i))
+                break;
+            inflated.wait(l);
+        }
+        pending.insert(i);
+        l.unlock();
+        Chunk chunk = inflateChunk(i);
+        l.lock();
+        store(i, chunk);
+        l.unlock();
+        inflated.notify_all();
+        return chunk;
+    }
+
+public:
+    CompressedImage(Reader fileRead, size_t cacheChunks = 128)
+        : fileRead(fileRead), chunkSize(0), imageSize(0),
+        cacheChunks(cacheChunks), prefetcher(0) {}
+    ~CompressedImage() {
+        delete prefetcher; // finishes the queued chunks first
+    }
+    static bool isImage(const char* header) {
+        return memcmp(header, magic, 8) == 0;
+    }
+    // fileSize is the size of the compressed file. Nothing in the header is
+    // trusted before it is checked against it.
+    bool open(uint64_t fileSize) {
+        char header[headerSize];
+        if (fileRead(header, 0, headerSize) != headerSize || !isImage(header))
+            return 0;
+#ifndef HAVE_ZLIB
+        return 0; // can't be inflated
+#endif
+        chunkSize = *(uint32_t*)(header + 8);
+        imageSize = *(uint64_t*)(header + 16);
+        uint64_t tableOffset = *(uint64_t*)(header + 24);
+        if (chunkSize == 0 || chunkSize > maxChunkSize ||
+            tableOffset < headerSize || tableOffset > fileSize)
+            return 0;
+        uint64_t chunks = imageSize / chunkSize + (imageSize % chunkSize != 0);
+        if (chunks + 1 > (fileSize - tableOffset) / sizeof(uint64_t))
+            return 0;
+        offsets.resize(chunks + 1);
+        uint64_t tableSize = offsets.size() * sizeof(uint64_t);
+        if (fileRead(offsets.data(), tableOffset, tableSize) !=
+            (int64_t)tableSize)
+            return 0;
+        if (offsets[0] < headerSize || offsets[chunks] > tableOffset)
+            return 0;
+        for (uint64_t i = 0; i < chunks; i++)
+            if (offsets[i + 1] < offsets[i] ||
+                offsets[i + 1] - offsets[i] > rawSize(i))
+                return 0;
+        return 1;
+    }
+    uint64_t size() { return imageSize; }
+    // Returns the number of bytes read, which is short at the image's end.
+    int64_t read(void* buffer, uint64_t pos, uint64_t bufferSize) {
+        int64_t total = 0;
+        while (bufferSize && pos < imageSize) {
+            uint64_t i = pos / chunkSize;
+            uint64_t skip = pos - i * chunkSize;
+            Chunk chunk = get(i);
+            if (!chunk)
+                return total ? total : -1;
+            uint64_t n = std::min<uint64_t>(bufferSize, chunk->size() - skip);
+            memcpy(buffer, chunk->data() + skip, n);
+            buffer = (char*)buffer + n;
+            pos += n;
+            bufferSize -= n;
+            total += n;
+        }
+        return total;
+    }
+    // Inflate the chunks of a range on the worker threads. At most half of
+    // the cache is prefetched so the chunks don't push each other out.
+    void prefetch(uint64_t pos, uint64_t size) {
+        if (pos >= imageSize || !size)
+            return;
+        uint64_t first = pos / chunkSize;
+        uint64_t last =
+            std::min(chunkCount(), (pos + size - 1) / chunkSize + 1);
+        last = std::min<uint64_t>(last, first + cacheChunks / 2);
+        std::lock_guard<std::mutex> l(cacheLock);
+        for (uint64_t i = first; i < last; i++) {
+            if (cache.count(i) || pending.count(i))
+                continue;
+            pending.insert(i);
+            if (!prefetcher)
+                prefetcher = new ThreadPool(
+                    std::min(4u,
+                        std::max(1u, std::thread::hardware_concurrency())));
+            prefetcher->post([this, i] {
+                Chunk chunk = inflateChunk(i);
+                {
+                    std::lock_guard<std::mutex> l(cacheLock);
+                    store(i, chunk);
+                }
+                inflated.notify_all();
+            });
+        }
+    }
+    // Write a compressed copy of a disk or raw image, deflating several
+    // chunks at once.
+    static bool convert(const char* from, const char* to,
+        uint32_t chunkSize = defaultChunkSize) {
+#ifdef HAVE_ZLIB
+        FILE* in = fopen(from, "rb");
+        if (!in)
+            return 0;
+        FILE* out = fopen(to, "wb");
+        if (!out) {
+            fclose(in);
+            return 0;
+        }
+        ThreadPool pool;
+        std::vector<std::vector<char>> raw(pool.size()), packed(pool.size());
+        std::vector<uint64_t> table{ headerSize };
+        uint64_t imageSize = 0;
+        char header[headerSize] = {};
+        bool ok = fwrite(header, 1, headerSize, out) == headerSize;
+        while (ok) {
+            size_t count = 0;
+            for (; count < raw.size(); count++) {
+                raw[count].resize(chunkSize);
+                size_t n = fread(raw[count].data(), 1, chunkSize, in);
+                raw[count].resize(n);
+                if (n < chunkSize)
+                    break;
+            }
+            if (count < raw.size() && raw[count].size())
+                count++;
+            if (!count)
+                break;
+            std::mutex m;
+            std::condition_variable cv;
+            size_t remaining = count;
+            for (size_t i = 0; i < count; i++)
+                pool.post([&, i] {
+                    uLongf length = compressBound(raw[i].size());
+                    packed[i].resize(length);
+                    if (compress2((Bytef*)packed[i].data(), &length,
+                        (const Bytef*)raw[i].data(), raw[i].size(),
+                        Z_DEFAULT_COMPRESSION) != Z_OK ||
+                        length >= raw[i].size())
+                        packed[i] = raw[i];
+                    else
+                        packed[i].resize(length);
+                    std::lock_guard<std::mutex> l(m);
+                    if (--remaining == 0)
+                        cv.notify_one();
+                });
+            {
+                std::unique_lock<std::mutex> l(m);
+                cv.wait(l, [&] { return remaining == 0; });
+            }
+            for (size_t i = 0; i < count && ok; i++) {
+                ok = fwrite(packed[i].data(), 1, packed[i].size(), out) ==
+                    packed[i].size();
+                table.push_back(table.back() + packed[i].size());
+                imageSize += raw[i].size();
+            }
+            if (raw[count - 1].size() < chunkSize)
+                break;
+        }
+        ok &= !ferror(in);
+        uint64_t tableOffset = table.back();
+        ok = ok && fwrite(table.data(), sizeof(uint64_t), table.size(), out) ==
+            table.size();
+        memcpy(header, magic, 8);
+        *(uint32_t*)(header + 8) = chunkSize;
+        *(uint64_t*)(header + 16) = imageSize;
+        *(uint64_t*)(header + 24) = tableOffset;
+        ok = ok && fseek(out, 0, SEEK_SET) == 0 &&
+            fwrite(header, 1, headerSize, out) == headerSize;
+        fclose(in);
+        ok &= fclose(out) == 0;
+        return ok;
+#else
+        return 0;
+#endif
+    }
+};
+
+// An opened disk or image. It owns the handle and everything done on the
+// raw byte stream: read-ahead, direct I/O, batched reads and a block cache
+// shared by all volumes (partitions) mounted from it.
+class Disk {
+#ifdef _WIN32
+    HANDLE hDisk;
+#else
+    int fd;
+#endif
+    int openError;
+    ReadAhead readAhead;
+    bool directIO;
+    AlignedBufferPool alignedBuffers;
+    // Readers not running a batch right now. Each batch takes one, so
+    // threads calling readBatch at the same time don't wait for each other.
+    std::vector<AsyncReader*> idleReaders;
+    CompressedImage* image;
+    std::mutex readAheadLock, alignedLock, batchLock;
+
+    // Small reads (boot sectors, FAT and directory clusters, MFT records,
+    // index blocks) are served from whole cached blocks, least recently
+    // used blocks are dropped first.
+    typedef std::pair<std::vector<char>, std::list<uint64_t>::iterator>
+        CachedBlock;
+    std::unordered_map<uint64_t, CachedBlock> cache;
+    std::list<uint64_t> cacheOrder;
+    std::mutex cacheLock;
+
+    // Positional read of the opened file, safe to call from several threads
+    // at once.
+    int64_t fileRead(void* buffer, uint64_t pos, uint64_t bufferSize) {
+#ifdef _WIN32
+        DWORD bytesRead;
+        OVERLAPPED o;
+        memset(&o, 0, sizeof(o));
+        o.Offset = (DWORD)pos;
+        o.OffsetHigh = (DWORD)(pos >> 32);
+        if (!ReadFile(hDisk, buffer, bufferSize, &bytesRead, &o))
+            return -1;
+        return bytesRead;
+#else
+        return pread(fd, buffer, bufferSize, pos);
+#endif
+    }
+    uint64_t fileSize() {
+#ifdef _WIN32
+        LARGE_INTEGER size;
+        return GetFileSizeEx(hDisk, &size) ? size.QuadPart : 0;
+#else
+        off_t size = lseek(fd, 0, SEEK_END);
+        return size < 0 ? 0 : size;
+#endif
+    }
+    // Positional read of the disk content, inflated for compressed images.
+    int64_t rawRead(void* buffer, uint64_t pos, uint64_t bufferSize) {
+        if (image)
+            return image->read(buffer, pos, bufferSize);
+        return fileRead(buffer, pos, bufferSize);
+    }
+    // Unbuffered devices only accept aligned offsets, sizes and buffers, so
+    // widen every request to the alignment and copy the asked part out.
+    int64_t readDirect(void* buffer, uint64_t pos, uint64_t bufferSize) {
+        const uint64_t align = AlignedBufferPool::alignment;
+        int64_t total = 0;
+        while (bufferSize) {
+            uint64_t start = pos & ~(align - 1);
+            uint64_t skip = pos - start;
+            uint64_t chunk =
+                std::min(bufferSize, AlignedBufferPool::bufferSize - skip);
+            uint64_t length = (skip + chunk + align - 1) & ~(align - 1);
+            char* aligned;
+            {
+                std::lock_guard<std::mutex> l(alignedLock);
+                aligned = alignedBuffers.acquire();
+            }
+            if (!aligned)
+                return -1;
+            int64_t bytesRead = fileRead(aligned, start, length);
+            if (bytesRead > (int64_t)skip) {
+                chunk = std::min(chunk, bytesRead - skip);
+                memcpy(buffer, aligned + skip, chunk);
+            }
+            {
+                std::lock_guard<std::mutex> l(alignedLock);
+                alignedBuffers.release(aligned);
+            }
+            if (bytesRead <= (int64_t)skip)
+                return total ? total : -1;
+            buffer = (char*)buffer + chunk;
+            pos += chunk;
+            bufferSize -= chunk;
+            total += chunk;
+            if ((uint64_t)bytesRead < length && bufferSize)
+                break; // end of device
+        }
+        return total;
+    }
+    // Returns the number of bytes read, which is short at the disk's end.
+    int64_t readUncached(void* buffer, uint64_t pos, uint64_t bufferSize) {
+        if (directIO && !image)
+            return readDirect(buffer, pos, bufferSize);
+        int64_t bytesRead = rawRead(buffer, pos, bufferSize);
+        if (bytesRead <= 0)
+            return bytesRead;
+        std::pair<uint64_t, uint64_t> next;
+        {
+            std::lock_guard<std::mutex> l(readAheadLock);
+            next = readAhead.access(pos, bufferSize);
+        }
+        if (next.second)
+            willNeed(next.first, next.second);
+        return bytesRead;
+    }
+    bool readCached(char* buffer, uint64_t pos, uint64_t bufferSize) {
+        while (bufferSize) {
+            uint64_t blockPos = pos & ~(blockSize - 1);
+            uint64_t skip = pos - blockPos;
+            uint64_t chunk = std::min(bufferSize, blockSize - skip);
+            std::unique_lock<std::mutex> l(cacheLock);
+            auto it = cache.find(blockPos);
+            if (it == cache.end()) {
+                l.unlock();
+                std::vector<char> block(blockSize);
+                int64_t bytesRead =
+                    readUncached(block.data(), blockPos, blockSize);
+                if (bytesRead < (int64_t)(skip + chunk))
+                    return 0;
+                block.resize(bytesRead);
+                l.lock();
+                it = cache.find(blockPos);
+                if (it == cache.end()) {
+                    cacheOrder.push_front(blockPos);
+                    it = cache.insert({ blockPos,
+                        { std::move(block), cacheOrder.begin() } }).first;
+                    if (cache.size() > cacheBlocks) {
+                        cache.erase(cacheOrder.back());
+                        cacheOrder.pop_back();
+                    }
+                }
+            }
+            else
+                cacheOrder.splice(cacheOrder.begin(), cacheOrder,
+                    it->second.second);
+            if (it->second.first.size() < skip + chunk)
+                return 0;
+            memcpy(buffer, it->second.first.data() + skip, chunk);
+            l.unlock();
+            buffer += chunk;
+            pos += chunk;
+            bufferSize -= chunk;
+        }
+        return 1;
+    }
+
+public:
+    static constexpr uint64_t blockSize = 64 * 1024;
+    static constexpr size_t cacheBlocks = 512;
+    // With directIO the disk is opened unbuffered, so whole-volume scans
+    // don't push everything else out of the host's page cache. Compressed
+    // images are recognized by their header and read inflated.
+    Disk(std::wstring diskPath, bool directIO = false)
+        : directIO(directIO), image(0) {
+#ifdef _WIN32
+        hDisk = CreateFileW(diskPath.c_str(), GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+            OPEN_EXISTING, directIO ? FILE_FLAG_NO_BUFFERING : 0, NULL);
+#else
+        std::string str = std::string(diskPath.begin(), diskPath.end());
+#ifdef O_DIRECT
+        fd = open(str.c_str(), O_RDONLY | (directIO ? O_DIRECT : 0));
+#else
+        fd = open(str.c_str(), O_RDONLY);
+#endif
+#endif
+        openError = isOpen() ? 0 : errno;
+        char header[CompressedImage::headerSize];
+        if ((directIO ? readDirect(header, 0, sizeof(header))
+            : fileRead(header, 0, sizeof(header))) == sizeof(header) &&
+            CompressedImage::isImage(header)) {
+            image = new CompressedImage(
+                [this](void* b, uint64_t p, uint64_t s) {
+                    return this->directIO ? readDirect(b, p, s)
+                        : fileRead(b, p, s);
+                });
+            if (!image->open(fileSize())) {
+                delete image;
+                image = 0;
+            }
+        }
+    }
+    ~Disk() {
+        delete image;
+#ifdef _WIN32
+        CloseHandle(hDisk);
+#else
+        close(fd);
+#endif
+        for (AsyncReader* reader : idleReaders)
+            delete reader;
+    }
+    bool isOpen() {
+#ifdef _WIN32
+        return hDisk != INVALID_HANDLE_VALUE;
+#else
+        return fd != -1;
+#endif
+    }
+    // The errno of opening the disk, 0 if it opened.
+    int error() { return openError; }
+    bool isCompressed() { return image != 0; }
+    // Drop cached blocks, for when the disk content changed underneath.
+    void invalidate() {
+        std::lock_guard<std::mutex> l(cacheLock);
+        cache.clear();
+        cacheOrder.clear();
+    }
+    bool read(void* buffer, uint64_t pos, uint64_t bufferSize) {
+        if (!isOpen())
+            return 0;
+        if (bufferSize <= blockSize)
+            return readCached((char*)buffer, pos, bufferSize);
+        return readUncached(buffer, pos, bufferSize) > 0;
+    }
+    // Read many ranges with up to 64 requests in flight. done is called for
+    // each request as soon as all of it has arrived, in completion order.
+    bool readBatch(std::vector<ReadRequest>& requests,
+        std::function<void(ReadRequest&)> done = nullptr) {
+        bool ok = true;
+        if (image) {
+            // Inflate the chunks of the next requests on the prefetch
+            // workers while this one is copied out.
+            const size_t ahead = 8;
+            for (size_t i = 0; i < requests.size(); i++) {
+                if (i == 0)
+                    for (size_t j = 0;
+                        j < std::min(ahead, requests.size()); j++)
+                        image->prefetch(requests[j].pos, requests[j].size);
+                else if (i + ahead - 1 < requests.size())
+                    image->prefetch(requests[i + ahead - 1].pos,
+                        requests[i + ahead - 1].size);
+                ReadRequest& r = requests[i];
+                r.ok = image->read(r.buffer, r.pos, r.size) > 0;
+                ok &= r.ok;
+                if (done)
+                    done(r);
+            }
+            return ok;
+        }
+        if (directIO) { // one aligned bounce buffer at a time
+            for (ReadRequest& r : requests) {
+                r.ok = readDirect(r.buffer, r.pos, r.size) > 0;
+                ok &= r.ok;
+                if (done)
+                    done(r);
+            }
+            return ok;
+        }
+        // Split big requests so a single long extent still keeps the
+        // device queue busy.
+        const uint64_t pieceSize = 1024 * 1024;
+        std::vector<ReadRequest> pieces;
+        std::vector<size_t> owner;
+        std::vector<size_t> remaining(requests.size());
+        for (size_t i = 0; i < requests.size(); i++) {
+            requests[i].ok = true;
+            for (uint64_t off = 0; off < requests[i].size; off += pieceSize) {
+                pieces.push_back({ (char*)requests[i].buffer + off,
+                    requests[i].pos + off,
+                    std::min(pieceSize, requests[i].size - off), false });
+                owner.push_back(i);
+                remaining[i]++;
+            }
+        }
+        AsyncReader* reader = 0;
+        {
+            std::lock_guard<std::mutex> l(batchLock);
+            if (!idleReaders.empty()) {
+                reader = idleReaders.back();
+                idleReaders.pop_back();
+            }
+        }
+        if (!reader)
+            reader = new AsyncReader(
+                [this](void* b, uint64_t p, uint64_t s) {
+                    return rawRead(b, p, s);
+                },
+#ifdef _WIN32
+                - 1);
+#else
+                fd);
+#endif
+        reader->run(pieces, [&](ReadRequest& piece) {
+            size_t i = owner[&piece - pieces.data()];
+            requests[i].ok &= piece.ok;
+            if (--remaining[i] == 0) {
+                ok &= requests[i].ok;
+                if (done)
+                    done(requests[i]);
+            }
+        });
+        std::lock_guard<std::mutex> l(batchLock);
+        idleReaders.push_back(reader);
+        return ok;
+    }
+    // Tell the kernel a range will be read soon so it is fetched in the
+    // background. Windows does its own read-ahead, so this is a no-op there.
+    void willNeed(uint64_t pos, uint64_t size) {
+        if (image) {
+            image->prefetch(pos, size);
+            return;
+        }
+#ifndef _WIN32
+        posix_fadvise(fd, pos, size, POSIX_FADV_WILLNEED);
+#endif
+    }
+};
+
+struct Partition {
+    uint64_t offset, size; // in bytes
+    std::wstring name;
+};
+
+// Reads MBR (including extended/logical partitions) and GPT partition
+// tables from the start of a disk.
+class PartitionTable {
+    static bool isExtended(uint8_t type) {
+        return type == 0x05 || type == 0x0F || type == 0x85;
+    }
+    static void readExtended(Disk& disk, uint64_t extendedStart,
+        std::vector<Partition>& rt) {
+        uint8_t ebr[512];
+        uint64_t next = extendedStart;
+        for (int guard = 0; guard < 128; guard++) {
+            if (!disk.read(ebr, next * 512, 512) ||
+                *(uint16_t*)(ebr + 510) != 0xAA55)
+                return;
+            uint8_t* logical = ebr + 0x1BE;
+            if (logical[4] != 0 && *(uint32_t*)(logical + 12))
+                rt.push_back({ (next + *(uint32_t*)(logical + 8)) * 512,
+                    (uint64_t) * (uint32_t*)(logical + 12) * 512,
+                    L"logical partition " + std::to_wstring(rt.size() + 1) });
+            uint8_t* link = ebr + 0x1CE;
+            if (!isExtended(link[4]) || *(uint32_t*)(link + 8) == 0)
+                return;
+            next = extendedStart + *(uint32_t*)(link + 8);
+        }
+    }
+    static bool readGPT(Disk& disk, uint64_t sectorSize,
+        std::vector<Partition>& rt) {
+        std::vector<char> header(sectorSize);
+        if (!disk.read(header.data(), sectorSize, sectorSize) ||
+            memcmp(header.data(), "EFI PART", 8) != 0)
+            return false;
+        uint64_t entriesLBA = *(uint64_t*)(header.data() + 72);
+        uint32_t count = *(uint32_t*)(header.data() + 80);
+        uint32_t entrySize = *(uint32_t*)(header.data() + 84);
+        // Entries are 128 bytes or a multiple of it. The table follows the
+        // header, and nothing real needs more than 1 MiB of it.
+        const uint64_t maxTableSize = 1024 * 1024;
+        if (entrySize < 128 || entrySize % 128 || entrySize > maxTableSize ||
+            count > maxTableSize / entrySize || entriesLBA < 2 ||
+            entriesLBA > UINT64_MAX / sectorSize - maxTableSize)
+            return false;
+        std::vector<char> entries((uint64_t)count * entrySize);
+        if (!disk.read(entries.data(), entriesLBA * sectorSize,
+            entries.size()))
+            return false;
+        static const char unused[16] = { 0 };
+        for (uint32_t i = 0; i < count; i++) {
+            char* e = entries.data() + (uint64_t)i * entrySize;
+            if (memcmp(e, unused, 16) == 0)
+                continue;
+            uint64_t first = *(uint64_t*)(e + 32), last = *(uint64_t*)(e + 40);
+            std::wstring name;
+            for (char16_t* c = (char16_t*)(e + 56); c < (char16_t*)(e + 128) &&
+                *c; c++)
+                name.push_back(*c);
+            if (name.empty())
+                name = L"partition " + std::to_wstring(i + 1);
+            rt.push_back({ first * sectorSize,
+                (last - first + 1) * sectorSize, name });
+        }
+        return true;
+    }
+
+public:
+    static std::vector<Partition> read(Disk& disk) {
+        std::vector<Partition> rt;
+        uint8_t mbr[512];
+        if (!disk.read(mbr, 0, 512) || *(uint16_t*)(mbr + 510) != 0xAA55)
+            return rt;
+        for (int i = 0; i < 4; i++)
+            if (mbr[0x1BE + i * 16 + 4] == 0xEE) { // protective MBR
+                if (!readGPT(disk, 512, rt))
+                    readGPT(disk, 4096, rt);
+                return rt;
+            }
+        for (int i = 0; i < 4; i++) {
+            uint8_t* entry = mbr + 0x1BE + i * 16;
+            uint32_t lba = *(uint32_t*)(entry + 8);
+            uint32_t count = *(uint32_t*)(entry + 12);
+            if (entry[4] == 0 || count == 0)
+                continue;
+            if (isExtended(entry[4]))
+                readExtended(disk, lba, rt);
+            else
+                rt.push_back({ (uint64_t)lba * 512, (uint64_t)count * 512,
+                    L"partition " + std::to_wstring(i + 1) });
+        }
+        return rt;
+    }
+};
+
+// Tracks loaded file contents and expanded directories. When together they
+// take more memory than the budget, the least recently used ones are
+// unloaded again: file data is freed and directory listings are dropped.
+class ContentCache {
+    std::list<Entry*> order; // most recently used first
+    std::unordered_map<Entry*,
+        std::pair<std::list<Entry*>::iterator, uint64_t>> items;
+    uint64_t used, budget;
+
+    void unload(Entry* e) {
+        if (File* file = dynamic_cast<File*>(e)) {
+            free(file->dataPtr);
+            file->dataPtr = 0;
+        }
+        else if (Folder* folder = dynamic_cast<Folder*>(e)) {
+            for (Entry* sub : folder->subEntries) {
+                forget(sub);
+                delete sub;
+            }
+            folder->subEntries.clear();
+            folder->loaded = false;
+        }
+    }
+    // Unload until the budget is met, never touching keep.
+    void shrink(Entry* keep = 0) {
+        while (used > budget) {
+            Entry* victim = 0;
+            for (auto it = order.rbegin(); it != order.rend(); ++it) {
+                Folder* folder = dynamic_cast<Folder*>(*it);
+                if (*it != keep && !(folder && folder->pins)) {
+                    victim = *it;
+                    break;
+                }
+            }
+            if (!victim)
+                return;
+            forgetOne(victim);
+            unload(victim);
+        }
+    }
+    void forgetOne(Entry* e) {
+        auto it = items.find(e);
+        if (it == items.end())
+            return;
+        used -= it->second.second;
+        order.erase(it->second.first);
+        items.erase(it);
+    }
+
+public:
+    ContentCache(uint64_t budget = 256 << 20) : used(0), budget(budget) {}
+    // Memory an entry's loaded content takes, roughly.
+    static uint64_t footprint(Entry* e) {
+        if (File* file = dynamic_cast<File*>(e))
+            return file->dataPtr ? file->size : 0;
+        Folder* folder = dynamic_cast<Folder*>(e);
+        if (!folder)
+            return 0;
+        uint64_t bytes = folder->subEntries.capacity() * sizeof(Entry*);
+        for (Entry* sub : folder->subEntries)
+            bytes += sizeof(TXT) + sub->name.capacity() * sizeof(wchar_t);
+        return bytes;
+    }
+    // Mark e as just used, returns false if it isn't cached.
+    bool touch(Entry* e) {
+        auto it = items.find(e);
+        if (it == items.end())
+            return false;
+        order.splice(order.begin(), order, it->second.first);
+        return true;
+    }
+    void insert(Entry* e, uint64_t bytes) {
+        forgetOne(e);
+        order.push_front(e);
+        items[e] = { order.begin(), bytes };
+        used += bytes;
+        shrink(e);
+    }
+    // Forget an entry and everything loaded below it, before it is deleted.
+    void forget(Entry* e) {
+        forgetOne(e);
+        if (Folder* folder = dynamic_cast<Folder*>(e))
+            for (Entry* sub : folder->subEntries)
+                forget(sub);
+    }
+    // Unload every cached file, their contents may be stale after a refresh.
+    void dropFiles() {
+        for (auto it = order.begin(); it != order.end();) {
+            Entry* e = *it++;
+            if (dynamic_cast<File*>(e)) {
+                forgetOne(e);
+                unload(e);
+            }
+        }
+    }
+    void setBudget(uint64_t bytes) {
+        budget = bytes;
+        shrink();
+    }
+    uint64_t getBudget() { return budget; }
+    uint64_t getUsed() { return used; }
+    size_t size() { return items.size(); }
+};
+
+// A number of bytes per unit (sector, cluster). Shifted is used for the
+// common power of two sizes, so code instantiated with it shifts by a
+// constant instead of multiplying and dividing.
+template <int Shift> struct Shifted {
+    uint64_t size() const { return uint64_t(1) << Shift; }
+    uint64_t bytes(uint64_t units) const { return units << Shift; }
+    uint64_t units(uint64_t bytes) const { return bytes >> Shift; }
+    uint64_t rest(uint64_t bytes) const { return bytes & (size() - 1); }
+};
+struct Scaled {
+    uint64_t unit;
+    uint64_t size() const { return unit; }
+    uint64_t bytes(uint64_t units) const { return units * unit; }
+    uint64_t units(uint64_t bytes) const { return bytes / unit; }
+    uint64_t rest(uint64_t bytes) const { return bytes % unit; }
+};
+
+// Layout of a volume, computed once by readInfo instead of from the packed
+// boot sector fields on every access.
+struct VolumeGeometry {
+    uint64_t sectorSize, clusterSize;
+    int sectorShift, clusterShift; // -1 if the size isn't a power of two
+    uint64_t dataBase;     // byte offset of cluster firstCluster
+    uint64_t firstCluster; // 2 on FAT32, 0 on NTFS
+    uint64_t clusterCount;
+    uint64_t recordSize;   // MFT record size, 0 on FAT32
+
+    static int log2(uint64_t size) {
+        if (size == 0 || (size & (size - 1)))
+            return -1;
+        int shift = 0;
+        while ((uint64_t(1) << shift) < size)
+            shift++;
+        return shift;
+    }
+    VolumeGeometry()
+        : sectorSize(0), clusterSize(0), sectorShift(-1), clusterShift(-1),
+        dataBase(0), firstCluster(0), clusterCount(0), recordSize(0) {}
+    void setSizes(uint64_t sector, uint64_t cluster) {
+        sectorSize = sector;
+        clusterSize = cluster;
+        sectorShift = log2(sector);
+        clusterShift = log2(cluster);
+    }
+    uint64_t clusterOffset(uint64_t cluster) const {
+        cluster -= firstCluster;
+        return dataBase + (clusterShift >= 0 ? cluster << clusterShift
+            : cluster * clusterSize);
+    }
+    bool validCluster(uint64_t cluster) const {
+        return cluster >= firstCluster &&
+            cluster - firstCluster < clusterCount;
+    }
+    // Run f with the cluster size as Shifted for 512 bytes to 64 KiB, or as
+    // Scaled for anything else.
+    template <class F> void withClusterSize(F f) const {
+        switch (clusterShift) {
+        case 9: f(Shifted<9>()); break;
+        case 10: f(Shifted<10>()); break;
+        case 11: f(Shifted<11>()); break;
+        case 12: f(Shifted<12>()); break;
+        case 13: f(Shifted<13>()); break;
+        case 14: f(Shifted<14>()); break;
+        case 15: f(Shifted<15>()); break;
+        case 16: f(Shifted<16>()); break;
+        default: f(Scaled{ clusterSize }); break;
+        }
+    }
+};
+
+// The timestamps of one file from one source, gathered for a timeline. ids
+// are unique within a volume; the root is its own parent.
+struct TimeRecord {
+    enum Source { DirectoryEntry, StandardInformation, FileName };
+    uint64_t id, parent;
+    uint64_t pos; // as in Entry::pos, to read the file with readFile
+    std::wstring name;
+    uint64_t size;
+    time_t modified, accessed, changed, created; // 0 if not recorded
+    Source source;
+    bool directory;
+};
+
+class Filesystem {
+protected:
+#pragma pack(push, 1) /* Byte align in memory (no padding) */
+    struct BIOS_PARAMETER_BLOCK {
+        uint8_t BS_jmpBoot[3]; /* Jump instruction to the boot code */
+        uint8_t BS_OEMName[8]; /* Name of system that formatted the volume */
+        uint16_t bytes_per_sector;           /* Size of a sector in bytes. */
+        uint8_t sectors_per_cluster;         /* Size of a cluster in sectors. */
+        uint16_t reserved_sectors;           /* zero */
+        uint8_t fats;                        /* zero */
+        uint16_t root_entries;               /* zero */
+        uint16_t sectors;                    /* zero */
+        uint8_t media_type;                  /* 0xf8 = hard disk */
+        uint16_t sectors_per_fat;            /* zero */
+        /*0x0d*/ uint16_t sectors_per_track; /* Required to boot Windows. */
+        /*0x0f*/ uint16_t heads;             /* Required to boot Windows. */
+        /*0x11*/ uint32_t hidden_sectors;    /* Offset to the start of the
+                                        partition    relative to the disk in
+                                        sectors.    Required to boot Windows. */
+    } *bpb;
+#pragma pack(pop) /* End strict alignment */
+
+    std::shared_ptr<Disk> disk;
+    uint64_t partitionOffset;
+    std::shared_ptr<ContentCache> cache;
+    VolumeGeometry geometry;
+
+public:
+    char* firstSector;
+    Folder* rootDirectory;
+    Filesystem()
+        : partitionOffset(0), cache(std::make_shared<ContentCache>()),
+        firstSector(new char[512]), rootDirectory(0) {
+        bpb = (BIOS_PARAMETER_BLOCK*)firstSector;
+    }
+    // partitionOffset is where the volume starts on the disk, in bytes. All
+    // positions handed to read are relative to it.
+    Filesystem(std::shared_ptr<Disk> disk, uint64_t partitionOffset = 0)
+        : Filesystem() {
+        this->disk = disk;
+        this->partitionOffset = partitionOffset;
+    }
+    Filesystem(std::wstring diskPath, bool directIO = false)
+        : Filesystem(std::make_shared<Disk>(diskPath, directIO)) {}
+    virtual void getData(Entry*) {};
+    // getData through the cache: a directory that is still expanded or a
+    // file whose content is still in memory is not read again.
+    void load(Entry* e) {
+        if (cache->touch(e))
+            return;
+        Folder* folder = dynamic_cast<Folder*>(e);
+        if (!(folder && folder->loaded))
+            getData(e);
+        uint64_t bytes = ContentCache::footprint(e);
+        if (bytes || folder)
+            cache->insert(e, bytes);
+    }
+    // Read part of a file's content without loading all of it. Returns the
+    // number of bytes read, less than size only at the end of the file.
+    virtual uint64_t readFile(Entry* file, uint64_t offset, void* buffer,
+        uint64_t size) {
+        return 0;
+    }
+    // The size of a file's content, which may differ from the size in its
+    // directory entry.
+    virtual uint64_t fileSize(Entry* e) { return e->size; }
+    // Space an entry takes on the volume.
+    virtual uint64_t allocatedSize(Entry* e) { return e->allocatedSize; }
+    // Totals of a directory tree, computed bottom-up and memoized on every
+    // folder in it. Only directories are loaded, never file contents.
+    const Usage& summarize(Folder* folder) {
+        std::set<uint64_t> path; // guards against directories looping back
+        return summarize(folder, path);
+    }
+    const Usage& summarize(Folder* folder, std::set<uint64_t>& path) {
+        if (folder->summarized)
+            return folder->usage;
+        Usage total = {};
+        path.insert(folder->pos);
+        folder->pins++; // keep the cache from unloading it meanwhile
+        load(folder);
+        for (Entry* e : folder->subEntries) {
+            Folder* sub = dynamic_cast<Folder*>(e);
+            // . and .. lead back up, also when du starts below the root.
+            if (sub && (path.count(sub->pos) || e->name == L"." ||
+                e->name == L".."))
+                continue;
+            total.allocated += allocatedSize(e);
+            total.newest = std::max(total.newest, e->lastModifiedTime);
+            if (sub) {
+                total.folders++;
+                total.add(summarize(sub, path));
+            }
+            else {
+                total.files++;
+                total.size += e->size;
+            }
+        }
+        folder->pins--;
+        path.erase(folder->pos);
+        folder->usage = total;
+        folder->summarized = true;
+        return folder->usage;
+    }
+    void shareCache(std::shared_ptr<ContentCache> shared) { cache = shared; }
+    ContentCache& getCache() { return *cache; }
+    // Stream the entries of a directory without adding them to the tree.
+    // The entry passed to visit is only valid during the call; returning
+    // false stops the listing.
+    virtual void enumerate(Folder* folder,
+        const std::function<bool(Entry*)>& visit) {
+        load(folder);
+        for (Entry* e : folder->subEntries)
+            if (!visit(e))
+                return;
+    }
+    // Visit the timestamps of every entry on the volume. This walks the
+    // directory tree, the root has id 0 and no times.
+    virtual void collectTimes(
+        const std::function<void(const TimeRecord&)>& visit) {
+        uint64_t nextId = 1;
+        std::set<uint64_t> visited; // the . and .. entries lead back up
+        std::function<void(Folder*, uint64_t)> walk = [&](Folder* folder,
+            uint64_t id) {
+            visited.insert(folder->pos);
+            folder->pins++; // keep the cache from unloading it meanwhile
+            enumerate(folder, [&](Entry* e) {
+                Folder* sub = dynamic_cast<Folder*>(e);
+                if (sub && visited.count(sub->pos))
+                    return true;
+                TimeRecord r = { nextId++, id, e->pos, e->name, e->size,
+                    e->lastModifiedTime, e->lastAccessTime, e->mftChangeTime,
+                    e->creationTime, TimeRecord::DirectoryEntry, sub != 0 };
+                visit(r);
+                if (sub)
+                    walk(sub, r.id);
+                return true;
+            });
+            folder->pins--;
+        };
+        visit({ 0, 0, rootDirectory->pos, L"", 0, 0, 0, 0, 0,
+            TimeRecord::DirectoryEntry, true });
+        walk(rootDirectory, 0);
+    }
+    // Visit every run of allocated clusters with the pos of the entry that
+    // owns it, UINT64_MAX if none does. what names the kind of run, or is
+    // empty for plain file data.
+    virtual void collectExtents(const std::function<void(uint64_t first,
+        uint64_t count, uint64_t owner, const wchar_t* what)>& visit) {}
+    // Re-parse only the loaded directories that changed on disk. Returns the
+    // number of directories re-read, or -1 if the filesystem can't tell.
+    virtual int refresh() { return -1; }
+    virtual const wchar_t* typeName() { return L""; }
+    // Boot sector fields as names and values, in the order to show them.
+    virtual void info(
+        std::vector<std::pair<std::wstring, std::wstring>>& fields) {
+        fields.push_back({ L"Bytes per sector",
+            std::to_wstring(bpb->bytes_per_sector) + L" (bytes)" });
+        fields.push_back({ L"Sectors per cluster",
+            std::to_wstring(bpb->sectors_per_cluster) });
+        fields.push_back({ L"Bootsector size",
+            std::to_wstring(bpb->reserved_sectors) });
+        fields.push_back({ L"Number of FATs", std::to_wstring(bpb->fats) });
+        fields.push_back({ L"Sectors per tracks",
+            std::to_wstring(bpb->sectors_per_track) });
+        fields.push_back({ L"Number of heads", std::to_wstring(bpb->heads) });
+        fields.push_back({ L"Hidden sectors",
+            std::to_wstring(bpb->hidden_sectors) });
+        if (partitionOffset)
+            fields.push_back({ L"Partition offset",
+                std::to_wstring(partitionOffset) + L" (bytes)" });
+    }
+    virtual void readInfo() { read(firstSector, 0, 512); }
+    virtual ~Filesystem() {
+        delete[] firstSector;
+        if (rootDirectory)
+            cache->forget(rootDirectory);
+        delete rootDirectory;
+    }
+    bool read(void* buffer, uint64_t pos, uint64_t bufferSize) {
+        return disk->read(buffer, partitionOffset + pos, bufferSize);
+    }
+    bool readBatch(std::vector<ReadRequest>& requests,
+        std::function<void(ReadRequest&)> done = nullptr) {
+        for (ReadRequest& r : requests)
+            r.pos += partitionOffset;
+        bool ok = disk->readBatch(requests, done);
+        for (ReadRequest& r : requests)
+            r.pos -= partitionOffset;
+        return ok;
+    }
+};
+
+class FAT32 : public Filesystem {
+private:
+#pragma pack(push, 1)            /* Byte align in memory (no padding) */
+    typedef struct {             // (total 16 bits--a unsigned short)
+        unsigned short sec : 5;  // low-order 5 bits are the seconds
+        unsigned short min : 6;  // next 6 bits are the minutes
+        unsigned short hour : 5; // high-order 5 bits are the hour
+    } FATTime;
+    typedef struct {              // (total 16 bits--a unsigned short)
+        unsigned short day : 5;   // low-order 5 bits are the day
+        unsigned short month : 4; // next 4 bits are the month
+        unsigned short year : 7;  // high-order 7 bits are the year
+    } FATDate;
+    struct FAT32BS {
+        uint32_t total_sectors_32;
+        uint32_t table_size_32;
+        uint16_t extended_flags;
+        uint16_t fat_version;
+        uint32_t root_cluster;
+        uint16_t fat_info;
+        uint16_t backup_BS_sector;
+        uint8_t reserved_0[12];
+        uint8_t drive_number;
+        uint8_t reserved_1;
+        uint8_t boot_signature;
+        uint32_t volume_id;
+        uint8_t volume_label[11];
+        uint8_t fat_type_label[8];
+    } *fat32bs;
+#pragma pack(pop) /* End strict alignment */
+    std::vector<uint32_t> fileAllocationTable;
+
+public:
+    void readInfo() {
+        Filesystem::readInfo();
+        fat32bs = (FAT32BS*)(firstSector + sizeof(BIOS_PARAMETER_BLOCK));
+        geometry.setSizes(bpb->bytes_per_sector,
+            uint64_t(bpb->bytes_per_sector) * bpb->sectors_per_cluster);
+        uint64_t dataSector =
+            bpb->reserved_sectors + uint64_t(bpb->fats) * fat32bs->table_size_32;
+        geometry.dataBase = dataSector * bpb->bytes_per_sector;
+        geometry.firstCluster = 2;
+        geometry.clusterCount = bpb->sectors_per_cluster &&
+            fat32bs->total_sectors_32 > dataSector
+            ? (fat32bs->total_sectors_32 - dataSector) /
+            bpb->sectors_per_cluster
+            : 0;
+    }
+    const wchar_t* typeName() { return L"FAT32"; }
+    void info(std::vector<std::pair<std::wstring, std::wstring>>& fields) {
+        Filesystem::info(fields);
+        fields.push_back({ L"RDET cluster", std::to_wstring(fat32bs->root_cluster) });
+        fields.push_back({ L"Total number of sectors",
+            std::to_wstring(fat32bs->total_sectors_32) });
+        fields.push_back({ L"FAT size",
+            std::to_wstring(fat32bs->table_size_32) });
+    }
+    // Directory entry times are local time with seconds in 2 second units.
+    // A zero date means the time isn't recorded.
+    static time_t toTime(const FATDate* date, const FATTime* time) {
+        if (*(uint16_t*)date == 0)
+            return 0;
+        tm input_time = { 0 };
+        input_time.tm_year = date->year + 1980 - 1900;
+        input_time.tm_mon = date->month - 1;
+        input_time.tm_mday = date->day;
+        if (time) {
+            input_time.tm_hour = time->hour;
+            input_time.tm_min = time->min;
+            input_time.tm_sec = time->sec * 2;
+        }
+        return mktime(&input_time);
+    }
+    void readFAT() {
+        uint64_t entries =
+            uint64_t(fat32bs->table_size_32) * bpb->bytes_per_sector / 4;
+        fileAllocationTable = std::vector<uint32_t>(entries);
+        read(fileAllocationTable.data(),
+            bpb->reserved_sectors * bpb->bytes_per_sector, entries * 4);
+        // Never look past the end of the table, whatever the boot sector says.
+        geometry.clusterCount =
+            std::min<uint64_t>(geometry.clusterCount,
+                entries > 2 ? entries - 2 : 0);
+    }
+    // The top four bits of a FAT32 entry are reserved.
+    uint32_t nextCluster(uint32_t cluster) {
+        return fileAllocationTable[cluster] & 0x0FFFFFFF;
+    }
+    // Walk a directory along its cluster chain. Up to 256 KiB of the chain
+    // is read at a time in one batch, a request per contiguous run, so a
+    // fragmented directory is read in parallel. A long name split over two
+    // batches is still put together, and nothing past the batch where visit
+    // returns false is read. visit gets each short entry with the long name
+    // in front of it.
+    void walkDirectory(uint32_t startCluster, const std::function<bool(
+        const char* entry, const std::wstring& longName)>& visit) {
+        const uint64_t clusterSize = geometry.clusterSize;
+        const uint64_t window = std::max<uint64_t>(1, 256 * 1024 / clusterSize);
+        std::vector<char> buffer(window * clusterSize);
+        std::wstring longName;
+        uint32_t cluster = startCluster;
+        uint64_t steps = 0; // a looping chain ends the walk
+        while (inChain(cluster) && steps < geometry.clusterCount) {
+            std::vector<ReadRequest> runs;
+            uint64_t count = 0;
+            while (count < window && inChain(cluster) &&
+                steps < geometry.clusterCount) {
+                uint32_t first = cluster;
+                uint64_t n = 0;
+                do {
+                    cluster = nextCluster(cluster);
+                    n++;
+                    steps++;
+                } while (count + n < window && cluster == first + n &&
+                    inChain(cluster) && steps < geometry.clusterCount);
+                runs.push_back({ buffer.data() + count * clusterSize,
+                    geometry.clusterOffset(first), n * clusterSize, false });
+                count += n;
+            }
+            if (!readBatch(runs))
+                return;
+            for (char* entry = buffer.data(),
+                *end = entry + count * clusterSize; entry < end;
+                entry += 32) {
+                if (*entry == 0)
+                    return;
+                if (*(unsigned char*)entry == 0xe5)
+                    continue;
+                if (*(entry + 0xb) == 0xF) {
+                    char16_t ucs2Data[13];
+                    memcpy(ucs2Data, entry + 0x1, 10);
+                    memcpy(&ucs2Data[5], entry + 0xe, 12);
+                    memcpy(&ucs2Data[11], entry + 0x1c, 4);
+                    std::wstring wstr(ucs2Data, ucs2Data + 13);
+                    longName.insert(0, wstr);
+                    continue;
+                }
+                if (!visit(entry, longName))
+                    return;
+                longName.clear();
+            }
+        }
+    }
+    // The kind of entry a short entry describes: 'D', 'T' or 'F'.
+    static char dirEntryKind(const char* entry) {
+        if (*(entry + 0xb) & 0x10)
+            return 'D';
+        return memcmp(entry + 0x8, "TXT", 3) == 0 ? 'T' : 'F';
+    }
+    void readDirEntry(Entry* e, const char* entry,
+        const std::wstring& longName) {
+        if (longName.length() == 0) {
+            e->name = std::wstring(entry, entry + 8);
+            Utility::trim(e->name);
+            if (isalnum(*(char*)(entry + 0x8)))
+                e->name.append(L"." + std::wstring(entry + 0x8, entry + 0xb));
+            Utility::trim(e->name);
+            std::transform(e->name.begin(), e->name.end(), e->name.begin(),
+                ::tolower);
+        }
+        else {
+            e->name = longName;
+            Utility::trim(e->name);
+        }
+        e->pos = *(uint16_t*)(entry + 0x1a) |
+            ((*(uint16_t*)(entry + 0x14)) << 16);
+        // ".." of a directory in the root stores cluster 0 for the root.
+        // Empty files store 0 too and must keep it, they own no clusters.
+        if (e->pos == 0 && (*(uint8_t*)(entry + 0xb) & 0x10))
+            e->pos = fat32bs->root_cluster;
+        e->size = *(uint32_t*)(entry + 0x1c);
+        e->attribute.data = *(uint8_t*)(entry + 0xb);
+        e->lastModifiedTime = toTime((FATDate*)(entry + 0x18),
+            (FATTime*)(entry + 0x16));
+        e->creationTime = toTime((FATDate*)(entry + 0x10),
+            (FATTime*)(entry + 0xe));
+        if (e->creationTime)
+            e->creationTime += *(uint8_t*)(entry + 0xd) / 100;
+        e->lastAccessTime = toTime((FATDate*)(entry + 0x12), 0);
+    }
+    std::vector<Entry*> readDET(uint32_t startCluster) {
+        std::vector<Entry*> directoryTree;
+        walkDirectory(startCluster,
+            [&](const char* entry, const std::wstring& longName) {
+                Entry* e;
+                switch (dirEntryKind(entry)) {
+                case 'D': e = new Folder; break;
+                case 'T': e = new TXT; break;
+                default: e = new File; break;
+                }
+                readDirEntry(e, entry, longName);
+                directoryTree.push_back(e);
+                return true;
+            });
+        return directoryTree;
+    }
+    // Stream a directory that isn't loaded straight from its clusters. One
+    // entry of each kind is reused for all of them.
+    void enumerate(Folder* folder, const std::function<bool(Entry*)>& visit) {
+        if (folder->loaded) {
+            Filesystem::enumerate(folder, visit);
+            return;
+        }
+        Folder subFolder;
+        File file;
+        TXT text;
+        walkDirectory(folder->pos,
+            [&](const char* entry, const std::wstring& longName) {
+                char kind = dirEntryKind(entry);
+                Entry* e = kind == 'D' ? (Entry*)&subFolder
+                    : kind == 'T' ? (Entry*)&text : &file;
+                readDirEntry(e, entry, longName);
+                return visit(e);
+            });
+    }
+    FAT32() {}
+    FAT32(std::wstring diskPath, bool directIO = false)
+        : FAT32(std::make_shared<Disk>(diskPath, directIO)) {}
+    FAT32(std::shared_ptr<Disk> disk, uint64_t partitionOffset = 0)
+        : Filesystem(disk, partitionOffset) {
+        readInfo();
+        // Sector and cluster sizes are powers of two on any FAT32 volume.
+        // Without a root directory the volume isn't mounted, see
+        // Volumes::mount.
+        if (geometry.sectorShift < 0 || geometry.clusterShift < 0)
+            return;
+        readFAT();
+        rootDirectory = new Folder;
+        rootDirectory->pos = fat32bs->root_cluster;
+        getData(rootDirectory);
+    }
+
+    // One pass over the FAT: chains start at the clusters nothing points
+    // to, the first cluster of a chain is the pos of its entry.
+    void collectExtents(const std::function<void(uint64_t first, uint64_t count,
+        uint64_t owner, const wchar_t* what)>& visit) {
+        const uint32_t bad = 0x0FFFFFF7;
+        uint64_t end = geometry.firstCluster + geometry.clusterCount;
+        std::vector<bool> pointedTo(end);
+        for (uint64_t c = geometry.firstCluster; c < end; c++) {
+            uint32_t next = nextCluster(c);
+            if (geometry.validCluster(next))
+                pointedTo[next] = true;
+        }
+        for (uint64_t c = geometry.firstCluster; c < end; c++) {
+            uint32_t value = nextCluster(c);
+            if (value == bad) {
+                visit(c, 1, UINT64_MAX, L"bad cluster");
+                continue;
+            }
+            if (value == 0 || pointedTo[c])
+                continue;
+            uint64_t first = c, count = 1, cluster = c;
+            for (uint64_t steps = 0; steps < geometry.clusterCount; steps++) {
+                uint32_t next = nextCluster(cluster);
+                if (!geometry.validCluster(next) || nextCluster(next) == 0)
+                    break;
+                if (next == first + count)
+                    count++;
+                else {
+                    visit(first, count, c, L"");
+                    first = next;
+                    count = 1;
+                }
+                cluster = next;
+            }
+            visit(first, count, c, L"");
+        }
+    }
+    bool inChain(uint32_t cluster) {
+        return geometry.validCluster(cluster) &&
+            nextCluster(cluster) != 0;
+    }
+    // The length of the cluster chain, from the FAT in memory.
+    uint64_t allocatedSize(Entry* e) {
+        if (e->pos == 0) // empty file
+            return 0;
+        uint64_t clusters = 0;
+        for (uint32_t i = e->pos; inChain(i) && clusters < geometry.clusterCount;
+            i = nextCluster(i))
+            clusters++;
+        return clusters * geometry.clusterSize;
+    }
+    bool readCluster(void* buffer, uint32_t cluster) {
+        return read(buffer, geometry.clusterOffset(cluster),
+            geometry.clusterSize);
+    }
+    // The clusters before offset are skipped in the FAT, which is in memory,
+    // so seeking doesn't read any data.
+    uint64_t readFile(Entry* e, uint64_t offset, void* buffer, uint64_t size) {
+        if (offset >= e->size)
+            return 0;
+        size = std::min(size, e->size - offset);
+        std::vector<ReadRequest> extents;
+        uint64_t done = 0;
+        geometry.withClusterSize([&](auto clusterSize) {
+            uint32_t cluster = e->pos;
+            for (uint64_t skip = clusterSize.units(offset);
+                skip && inChain(cluster); skip--)
+                cluster = nextCluster(cluster);
+            uint64_t inCluster = clusterSize.rest(offset);
+            while (done < size && inChain(cluster)) {
+                uint64_t piece = std::min(clusterSize.size() - inCluster, size - done);
+                uint64_t pos = geometry.dataBase + inCluster +
+                    clusterSize.bytes(cluster - geometry.firstCluster);
+                if (!extents.empty() &&
+                    extents.back().pos + extents.back().size == pos)
+                    extents.back().size += piece;
+                else
+                    extents.push_back({ (char*)buffer + done, pos, piece,
+                        false });
+                done += piece;
+                inCluster = 0;
+                cluster = nextCluster(cluster);
+            }
+        });
+        return readBatch(extents) ? done : 0;
+    }
+    void getData(Entry* e) {
+        if (dynamic_cast<File*>(e)) {
+            std::vector<uint32_t> clusters;
+            for (uint32_t i = e->pos; inChain(i); i = nextCluster(i))
+                clusters.push_back(i);
+            void* data = malloc(clusters.size() * geometry.clusterSize);
+            // One request per contiguous extent of the chain.
+            std::vector<ReadRequest> extents;
+            geometry.withClusterSize([&](auto clusterSize) {
+                for (uint32_t i = 0, j; i < clusters.size(); i = j) {
+                    for (j = i + 1; j < clusters.size() &&
+                        clusters[j] == clusters[j - 1] + 1;
+                        j++)
+                        ;
+                    extents.push_back({ (char*)data + clusterSize.bytes(i),
+                        geometry.clusterOffset(clusters[i]),
+                        clusterSize.bytes(j - i), false });
+                }
+            });
+            readBatch(extents);
+            dynamic_cast<File*>(e)->dataPtr = data;
+        }
+        else {
+            dynamic_cast<Folder*>(e)->subEntries = readDET(e->pos);
+            dynamic_cast<Folder*>(e)->loaded = true;
+        }
+    }
+};
+
+class NTFS : public Filesystem {
+private:
+#pragma pack(push, 1) /* Byte align in memory (no padding) */
+    struct NTFSBS {
+        /*0x15*/ uint32_t large_sectors; /* zero */
+        uint8_t physical_drive;          /* 0x00 floppy, 0x80 hard disk */
+        uint8_t current_head;            /* zero */
+        uint8_t extended_boot_signature; /* 0x80 */
+        uint8_t reserved2;               /* zero */
+        /*0x28*/ int64_t number_of_sectors;
+        uint64_t mft_lcn;                /* Cluster location of mft data. */
+        uint64_t mftmirr_lcn;            /* Cluster location of copy of mft. */
+        uint8_t clusters_per_mft_record; /* Mft record size in clusters. */
+        uint8_t reserved0[3];            /* zero */
+        uint8_t clusters_per_index_record; /* Index block size in clusters. */
+        uint8_t reserved1[3];              /* zero */
+        uint64_t volume_serial_number;     /* Irrelevant (serial number). */
+        uint32_t checksum;                 /* Boot sector checksum. */
+        /*0x54*/ uint8_t bootstrap[426];   /* Irrelevant (boot up code). */
+        uint16_t end_of_sector_marker;     /* End of bootsector magic. Always is
+                                              0xaa55 in little endian. */
+                                              /* sizeof() = 512 (0x200) bytes */
+    } *ntfsbs;
+
+    struct MFT_REFERENCE {
+        uint64_t indx : 48;
+        uint64_t sequenceNumber : 16;
+    };
+
+    typedef struct {
+        uint32_t magic;     /* Usually the magic is "FILE". */
+        uint16_t usa_ofs;   /* See NTFS_RECORD definition above. */
+        uint16_t usa_count; /* See NTFS_RECORD definition above. */
+        /*  8*/ uint64_t lsn;
+        /* 16*/ uint16_t sequence_number;
+        /* 18*/ uint16_t link_count;
+        /* 20*/ uint16_t attrs_offset;
+        /* 22*/ uint16_t flags;
+        /* 24*/ uint32_t bytes_in_use;
+        /* 28*/ uint32_t bytes_allocated;
+        /* 32*/ MFT_REFERENCE base_mft_record;
+        uint16_t next_attr_instance;
+        /* 42*/ uint16_t reserved;          /* Reserved/alignment. */
+        /* 44*/ uint32_t mft_record_number; /* Number of this mft record. */
+    } MFT_RECORD;
+
+    typedef struct {
+        /*Ofs*/
+        /*  0*/ uint32_t type; /* The (32-bit) type of the attribute. */
+        /*  4*/ uint32_t length;
+        /*  8*/ uint8_t non_resident;
+        /*  9*/ uint8_t name_length;
+        /* 10*/ uint16_t name_offset;
+        /* 12*/ uint16_t flags; /* Flags describing the attribute. */
+        /* 14*/ uint16_t instance;
+        /* 16*/ union {
+            struct {
+                /* 16 */ uint32_t
+                    value_length; /* Byte size of attribute value. */
+                /* 20 */ uint16_t value_offset;
+                /* 22 */ uint8_t resident_flags; /* See above. */
+                /* 23 */ int8_t reservedR;
+                /* 24 */ void* resident_end[0];
+            };
+            struct {
+                /* 16*/ uint64_t lowest_vcn;
+                /* 24*/ uint64_t highest_vcn;
+                /* 32*/ uint16_t mapping_pairs_offset;
+                /* 34*/ uint8_t compression_unit;
+                /* 35*/ uint8_t reserved1[5];
+                /* 40*/ int64_t allocated_size;
+                /* 48*/ int64_t data_size;
+                /* 56*/ int64_t initialized_size;
+                /* 64 */ int64_t non_resident_end;
+                /* 72 */ void* compressed_end[0];
+            };
+        };
+    } ATTR_RECORD;
+
+    typedef struct {
+        /*  0*/ uint32_t type;   /* Type of referenced attribute. */
+        /*  4*/ uint16_t length; /* Byte size of this entry. */
+        /*  6*/ uint8_t name_length;
+        /*  7*/ uint8_t name_offset;
+        /*  8*/ uint64_t lowest_vcn;
+        /* 16*/ MFT_REFERENCE mft_reference;
+        /* 24*/ uint16_t instance;
+        /* 26*/ uint16_t name[0];
+    } ATTR_LIST_ENTRY;
+
+    typedef struct {
+        /*  0*/ uint32_t entries_offset;
+        /*  4*/ uint32_t index_length;
+        /*  8*/ uint32_t allocated_size;
+        /* 12*/ uint8_t ih_flags;    /* Bit field of INDEX_HEADER_FLAGS.  */
+        /* 13*/ uint8_t reserved[3]; /* Reserved/align to 8-byte boundary.*/
+    } INDEX_HEADER;
+
+    typedef struct {
+        /*  0*/ uint32_t type;
+        /*  4*/ uint32_t collation_rule;
+        /*  8*/ uint32_t index_block_size;
+        /* 12*/ int8_t clusters_per_index_block;
+        /* 13*/ uint8_t reserved[3]; /* Reserved/align to 8-byte boundary. */
+        /* 16*/ INDEX_HEADER index;
+    } INDEX_ROOT;
+
+    typedef struct {
+        uint32_t magic;     /* Magic is "INDX". */
+        uint16_t usa_ofs;   /* See NTFS_RECORD definition. */
+        uint16_t usa_count; /* See NTFS_RECORD definition. */
+        /*  8*/ uint64_t lsn;
+        /* 16*/ uint64_t index_block_vcn;
+        /* 24*/ INDEX_HEADER index; /* Describes the following index entries. */
+    } INDEX_ALLOCATION;
+
+    typedef struct {
+        union { /* Only valid when INDEX_ENTRY_END is not set. */
+            MFT_REFERENCE indexed_file;
+            struct {
+                uint16_t data_offset;
+                uint16_t data_length; /* Data length in bytes. */
+                uint32_t reservedV;   /* Reserved (zero). */
+            };
+        };
+        /*  8*/ uint16_t length;
+        /* 10*/ uint16_t key_length;
+        /* 12*/ uint16_t ie_flags; /* Bit field of INDEX_ENTRY_* flags. */
+        /* 14*/ uint16_t reserved;
+    } INDEX_ENTRY;
+
+    typedef struct {
+        /*  0*/ MFT_REFERENCE parent_directory;
+        /*  8*/ int64_t creation_time; /* Time file was created. */
+        /* 10*/ int64_t last_data_change_time;
+        /* 18*/ int64_t last_mft_change_time;
+        /* 20*/ int64_t last_access_time;
+        /* 28*/ int64_t allocated_size;
+        /* 30*/ int64_t data_size;
+        /* 38*/ uint32_t file_attributes; /* Flags describing the file. */
+        /* 3c*/ union {
+            /* 3c*/ struct {
+                /* 3c*/ uint16_t packed_ea_size;
+                /* 3e*/ uint16_t reserved; /* Reserved for alignment. */
+            };
+            /* 3c*/ uint32_t reparse_point_tag;
+        };
+        /* 40*/ uint8_t file_name_length;
+        /* 41*/ uint8_t file_name_type; /* Namespace of the file name.*/
+        /* 42*/ char16_t* file_name;    /* File name in Unicode. */
+    } FILE_NAME_ATTR;
+
+#pragma pack(pop) /* End strict alignment */
+    uint64_t clusters_per_index_record, clusters_per_mft_record,
+        index_block_size;
+    bool mft_record_size_in_bytes;
+
+    // Last seen header state of every directory record we parsed, used to
+    // find out which directories changed since then without re-parsing them.
+    struct RecordState {
+        uint64_t lsn;
+        uint16_t sequence_number;
+    };
+    std::map<uint64_t, RecordState> catalog;
+
+    // $STANDARD_INFORMATION and $FILE_NAME (from its offset 8) both start
+    // with the times created, modified, MFT changed and accessed.
+    void readTimes(char* times, time_t& created, time_t& modified,
+        time_t& changed, time_t& accessed) {
+        time_t* out[] = { &created, &modified, &changed, &accessed };
+        for (int i = 0; i < 4; i++) {
+            int64_t value = *(int64_t*)(times + 8 * i);
+            *out[i] = value ? convertWindowsTimeToUnixTime(value) : 0;
+        }
+    }
+    time_t convertWindowsTimeToUnixTime(long long int input) {
+        long long int temp;
+        temp = input / 10000000; // convert from 100ns intervals to seconds;
+        temp =
+            temp - 11644473600LL; // subtract number of seconds between epochs
+        return (time_t)temp;
+    }
+
+    // Undo the update sequence array of a multi-sector record (FILE or
+    // INDX): the last two bytes of every sector must hold the update
+    // sequence number and get their original value back from the array.
+    bool restoreFixup(char* data, uint64_t size) {
+        uint16_t usaOffset = *(uint16_t*)(data + 4);
+        uint16_t usaCount = *(uint16_t*)(data + 6);
+        // The stride is 512 bytes whatever the sector size of the volume.
+        const uint64_t stride = 512;
+        if (usaCount == 0 || usaOffset + usaCount * 2u > stride ||
+            (usaCount - 1) * stride > size)
+            return false;
+        uint16_t* usa = (uint16_t*)(data + usaOffset);
+        char* sector = data + stride;
+        for (int i = 1; i < usaCount; i++, sector += stride) {
+            if (*(uint16_t*)(sector - 2) != usa[0])
+                return false;
+            *(uint16_t*)(sector - 2) = usa[i];
+        }
+        return true;
+    }
+
+    // Decodes a mapping-pairs array in place. lcn is absolute; sparse runs
+    // have no clusters on disk.
+    class RunListReader {
+        const uint8_t *pos, *end;
+        int64_t lcn;
+
+        static int64_t readField(const uint8_t* p, int size, bool isSigned) {
+            int64_t value = 0;
+            for (int i = size - 1; i >= 0; i--)
+                value = (value << 8) | p[i];
+            if (isSigned && size && size < 8 && (p[size - 1] & 0x80))
+                value -= (int64_t)1 << (size * 8);
+            return value;
+        }
+
+    public:
+        RunListReader(const char* start, const char* end)
+            : pos((const uint8_t*)start), end((const uint8_t*)end), lcn(0) {}
+        bool next(uint64_t& length, uint64_t& runLcn, bool& sparse) {
+            if (pos >= end || *pos == 0)
+                return false;
+            int lengthSize = *pos & 15, offsetSize = *pos >> 4;
+            if (lengthSize == 0 || lengthSize > 8 || offsetSize > 8 ||
+                pos + 1 + lengthSize + offsetSize > end)
+                return false;
+            length = readField(pos + 1, lengthSize, false);
+            sparse = offsetSize == 0;
+            if (!sparse)
+                lcn += readField(pos + 1 + lengthSize, offsetSize, true);
+            runLcn = lcn;
+            pos += 1 + lengthSize + offsetSize;
+            return true;
+        }
+    };
+
+    // A non-owning view of one attribute inside a cached MFT record.
+    struct AttributeView {
+        ATTR_RECORD* attr;
+        uint64_t recordNumber;
+        uint32_t type() const { return attr->type; }
+        bool resident() const { return attr->non_resident == 0; }
+        bool unnamed() const { return attr->name_length == 0; }
+        bool named(const char16_t* name, uint8_t length) const {
+            return attr->name_length == length &&
+                memcmp((char*)attr + attr->name_offset, name,
+                    length * sizeof(char16_t)) == 0;
+        }
+        char* value() const { return (char*)attr + attr->value_offset; }
+        uint32_t valueLength() const { return attr->value_length; }
+        RunListReader runs() const {
+            return RunListReader((char*)attr + attr->mapping_pairs_offset,
+                (char*)attr + attr->length);
+        }
+    };
+
+    // Walks the attributes of a file, optionally only one type. With an
+    // $ATTRIBUTE_LIST the walk follows the list into the extension records.
+    // Views point into the record cache and stay valid while fewer than
+    // recordCacheSlots other records are loaded.
+    class AttributeIterator {
+        NTFS* fs;
+        uint64_t base;
+        uint32_t filter;
+        char* record;
+        ATTR_RECORD* attr;
+        const char *list, *listEnd;
+
+        static ATTR_RECORD* next(char* record, ATTR_RECORD* attr,
+            uint64_t recordSize) {
+            if ((char*)attr + 8 > record + recordSize ||
+                attr->type == 0xFFFFFFFF || attr->length == 0 ||
+                (char*)attr + attr->length > record + recordSize)
+                return 0;
+            return attr;
+        }
+        static ATTR_RECORD* first(char* record, uint64_t recordSize) {
+            return next(record,
+                (ATTR_RECORD*)(record + ((MFT_RECORD*)record)->attrs_offset),
+                recordSize);
+        }
+
+    public:
+        AttributeIterator(NTFS* fs, uint64_t indx, uint32_t filter = 0)
+            : fs(fs), base(indx), filter(filter), attr(0), list(0),
+            listEnd(0) {
+            record = fs->loadRecord(indx);
+            if (!record)
+                return;
+            uint64_t recordSize = fs->geometry.recordSize;
+            attr = first(record, recordSize);
+            for (ATTR_RECORD* a = attr; a; a = next(record,
+                (ATTR_RECORD*)((char*)a + a->length), recordSize))
+                if (a->type == 0x20) { // $ATTRIBUTE_LIST
+                    if (fs->readAttributeList(AttributeView{ a, indx })) {
+                        list = fs->attributeList.data();
+                        listEnd = list + fs->attributeList.size();
+                    }
+                    break;
+                }
+        }
+        bool valid() { return record != 0; }
+        bool next(AttributeView& view) {
+            if (list) {
+                while (list + sizeof(ATTR_LIST_ENTRY) <= listEnd) {
+                    ATTR_LIST_ENTRY* e = (ATTR_LIST_ENTRY*)list;
+                    if (e->length == 0)
+                        break;
+                    list += e->length;
+                    if (filter && e->type != filter)
+                        continue;
+                    uint64_t indx = e->mft_reference.indx;
+                    char* r = fs->loadRecord(indx);
+                    if (!r)
+                        continue;
+                    uint64_t recordSize = fs->geometry.recordSize;
+                    for (ATTR_RECORD* a = first(r, recordSize); a;
+                        a = next(r, (ATTR_RECORD*)((char*)a + a->length),
+                            recordSize))
+                        if (a->type == e->type && a->instance == e->instance) {
+                            view = { a, indx };
+                            return true;
+                        }
+                }
+                return false;
+            }
+            while (attr) {
+                ATTR_RECORD* a = attr;
+                attr = next(record, (ATTR_RECORD*)((char*)a + a->length),
+                    fs->geometry.recordSize);
+                if (!filter || a->type == filter) {
+                    view = { a, base };
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    // Least recently used cache of fixed-up MFT records.
+    static const int recordCacheSlots = 16;
+    std::vector<char> recordCache;
+    uint64_t cachedRecord[recordCacheSlots], cachedUse[recordCacheSlots];
+    uint64_t cacheClock;
+    std::vector<char> attributeList;
+    // Lets readFile be called from several threads; it is the only entry
+    // point that may be.
+    std::mutex metadataLock;
+    // Where the MFT itself lives, from the $DATA runs of record 0.
+    std::vector<std::pair<uint64_t, uint64_t>> mftRuns; // (lcn, clusters)
+    // Records read ahead by a linear scan of the MFT, not fixed up yet.
+    std::vector<char> scanBuffer;
+    uint64_t scanFirst, scanCount;
+
+    char* loadRecord(uint64_t indx) {
+        int victim = 0;
+        for (int i = 0; i < recordCacheSlots; i++) {
+            if (cachedRecord[i] == indx) {
+                cachedUse[i] = ++cacheClock;
+                return recordCache.data() + i * geometry.recordSize;
+            }
+            if (cachedUse[i] < cachedUse[victim])
+                victim = i;
+        }
+        char* slot = recordCache.data() + victim * geometry.recordSize;
+        cachedRecord[victim] = UINT64_MAX;
+        cachedUse[victim] = 0;
+        if (!getMFTEntryData(slot, indx))
+            return 0;
+        cachedRecord[victim] = indx;
+        cachedUse[victim] = ++cacheClock;
+        return slot;
+    }
+    void dropRecordCache() {
+        for (int i = 0; i < recordCacheSlots; i++)
+            cachedRecord[i] = UINT64_MAX, cachedUse[i] = 0;
+    }
+    bool readAttributeList(const AttributeView& view) {
+        if (view.resident()) {
+            attributeList.assign(view.value(),
+                view.value() + view.valueLength());
+            return true;
+        }
+        attributeList.resize(view.attr->data_size);
+        return readNonResident(view, attributeList.data(),
+            attributeList.size());
+    }
+    // Read the clusters of a non-resident attribute fragment into buffer,
+    // up to size bytes; sparse runs read as zeroes.
+    bool readNonResident(const AttributeView& view, char* buffer,
+        uint64_t size) {
+        uint64_t written = 0;
+        std::vector<ReadRequest> runs;
+        geometry.withClusterSize([&](auto clusterSize) {
+            uint64_t length, lcn;
+            bool sparse;
+            RunListReader reader = view.runs();
+            while (written < size && reader.next(length, lcn, sparse)) {
+                uint64_t runSize = std::min(clusterSize.bytes(length), size - written);
+                if (sparse)
+                    memset(buffer + written, 0, runSize);
+                else
+                    runs.push_back({ buffer + written, clusterSize.bytes(lcn),
+                        runSize, false });
+                written += runSize;
+            }
+        });
+        if (written < size)
+            memset(buffer + written, 0, size - written);
+        return readBatch(runs);
+    }
+    // Byte offset of an MFT record on the volume, following the MFT's own
+    // run list when it is known (the MFT can be fragmented).
+    uint64_t mftRecordOffset(uint64_t indx) {
+        uint64_t offset = indx * geometry.recordSize, rt = UINT64_MAX;
+        geometry.withClusterSize([&](auto clusterSize) {
+            for (auto& run : mftRuns) {
+                uint64_t runSize = clusterSize.bytes(run.second);
+                if (offset < runSize) {
+                    rt = clusterSize.bytes(run.first) + offset;
+                    return;
+                }
+                offset -= runSize;
+            }
+            rt = clusterSize.bytes(ntfsbs->mft_lcn) +
+                indx * geometry.recordSize;
+        });
+        return rt;
+    }
+    void readMFTRuns() {
+        AttributeIterator it(this, 0, 0x80);
+        AttributeView view;
+        std::vector<std::pair<uint64_t, uint64_t>> runs;
+        while (it.next(view)) {
+            if (view.resident() || !view.unnamed())
+                continue;
+            uint64_t length, lcn;
+            bool sparse;
+            RunListReader reader = view.runs();
+            while (reader.next(length, lcn, sparse))
+                runs.push_back({ lcn, length });
+        }
+        mftRuns = runs;
+        dropRecordCache();
+    }
+
+public:
+    NTFS(std::wstring diskPath, bool directIO = false)
+        : NTFS(std::make_shared<Disk>(diskPath, directIO)) {}
+    NTFS(std::shared_ptr<Disk> disk, uint64_t partitionOffset = 0)
+        : Filesystem(disk, partitionOffset), cacheClock(0), scanFirst(0),
+        scanCount(0) {
+        readInfo();
+        recordCache.resize(recordCacheSlots * geometry.recordSize);
+        dropRecordCache();
+        readMFTRuns();
+        // Without a readable root directory the volume isn't mounted, see
+        // Volumes::mount.
+        Entry* root = readMFTEntry(0, 5);
+        rootDirectory = dynamic_cast<Folder*>(root);
+        if (!rootDirectory) {
+            delete root;
+            return;
+        }
+        rootDirectory->pos = 5;
+        //test->printName();
+        //rootDirectory->pos = 5;
+        //getData(rootDirectory);
+    }
+    void readInfo() {
+        Filesystem::readInfo();
+        ntfsbs = (NTFSBS*)(firstSector + sizeof(BIOS_PARAMETER_BLOCK));
+        uint64_t sectors_per_cluster = (bpb->sectors_per_cluster >= 244)
+            ? 1 << (256 - bpb->sectors_per_cluster)
+            : bpb->sectors_per_cluster;
+        geometry.setSizes(bpb->bytes_per_sector,
+            sectors_per_cluster * bpb->bytes_per_sector);
+        geometry.clusterCount = sectors_per_cluster
+            ? ntfsbs->number_of_sectors / sectors_per_cluster : 0;
+        clusters_per_index_record =
+            (ntfsbs->clusters_per_index_record > 127)
+            ? 1 << (256 - ntfsbs->clusters_per_index_record)
+            : ntfsbs->clusters_per_index_record;
+        if (ntfsbs->clusters_per_mft_record > 127) {
+            clusters_per_mft_record =
+                1 << (256 - ntfsbs->clusters_per_mft_record);
+            mft_record_size_in_bytes = true;
+        }
+        else {
+            mft_record_size_in_bytes = false;
+            clusters_per_mft_record = ntfsbs->clusters_per_mft_record;
+        }
+        geometry.recordSize = clusters_per_mft_record *
+            (mft_record_size_in_bytes ? 1 : geometry.clusterSize);
+        index_block_size = (ntfsbs->clusters_per_index_record > 127)
+            ? clusters_per_index_record
+            : clusters_per_index_record * geometry.clusterSize;
+    }
+    const wchar_t* typeName() { return L"NTFS"; }
+    void info(std::vector<std::pair<std::wstring, std::wstring>>& fields) {
+        Filesystem::info(fields);
+        fields.push_back({ L"Total number of sectors",
+            std::to_wstring(ntfsbs->number_of_sectors) });
+        fields.push_back({ L"MFT cluster", std::to_wstring(ntfsbs->mft_lcn) });
+        fields.push_back({ L"Clusters per Index block",
+            std::to_wstring(clusters_per_index_record) });
+        fields.push_back({ L"Clusters per MFT record",
+            std::to_wstring(clusters_per_mft_record) +
+            (mft_record_size_in_bytes ? L" (bytes)" : L" (sectors)") });
+    }
+    bool readCluster(void* buffer, uint64_t cluster) {
+        return read(buffer, geometry.clusterOffset(cluster),
+            geometry.clusterSize);
+    }
+    void readMFT() {}
+    // Read MFT record indx into buffer (one record long) and undo
+    // its fixups. Fails for records that are not in use as FILE records.
+    bool getMFTEntryData(char* buffer, uint64_t indx) {
+        if (indx - scanFirst < scanCount)
+            memcpy(buffer, scanBuffer.data() +
+                (indx - scanFirst) * geometry.recordSize, geometry.recordSize);
+        else if (!read(buffer, mftRecordOffset(indx), geometry.recordSize))
+            return false;
+        if (memcmp(buffer, "FILE", 4) != 0 ||
+            !restoreFixup(buffer, geometry.recordSize))
+            return false;
+        return true;
+    }
+    bool readMFTHeader(MFT_RECORD& header, uint64_t indx) {
+        return read(&header, mftRecordOffset(indx), sizeof(MFT_RECORD));
+    }
+    bool recordChanged(uint64_t indx) {
+        MFT_RECORD header;
+        if (!readMFTHeader(header, indx))
+            return false;
+        auto it = catalog.find(indx);
+        return it == catalog.end() || it->second.lsn != header.lsn ||
+            it->second.sequence_number != header.sequence_number;
+    }
+    // Re-read a directory whose record changed. Entries that still exist keep
+    // their objects, so already loaded subdirectories stay loaded.
+    int refreshFolder(Folder* folder) {
+        int count = 0;
+        if (recordChanged(folder->pos)) {
+            std::vector<Entry*> old = folder->subEntries;
+            readMFTEntry(folder, folder->pos);
+            std::multimap<uint64_t, Entry*> byPos;
+            for (Entry* e : old)
+                byPos.insert({ e->pos, e });
+            for (Entry*& e : folder->subEntries) {
+                auto range = byPos.equal_range(e->pos);
+                for (auto it = range.first; it != range.second; ++it) {
+                    Entry* o = it->second;
+                    if (o->name == e->name &&
+                        (dynamic_cast<Folder*>(o) != 0) ==
+                        (dynamic_cast<Folder*>(e) != 0)) {
+                        o->size = e->size;
+                        o->allocatedSize = e->allocatedSize;
+                        o->attribute = e->attribute;
+                        o->lastModifiedTime = e->lastModifiedTime;
+                        o->creationTime = e->creationTime;
+                        o->lastAccessTime = e->lastAccessTime;
+                        o->mftChangeTime = e->mftChangeTime;
+                        delete e;
+                        e = o;
+                        byPos.erase(it);
+                        break;
+                    }
+                }
+            }
+            for (auto& removed : byPos) {
+                cache->forget(removed.second);
+                delete removed.second;
+            }
+            if (cache->touch(folder))
+                cache->insert(folder, ContentCache::footprint(folder));
+            folder->summarized = false;
+            count++;
+        }
+        for (Entry* e : folder->subEntries) {
+            Folder* sub = dynamic_cast<Folder*>(e);
+            if (sub && sub->loaded)
+                count += refreshFolder(sub);
+            // Unloaded directories aren't checked, their totals may be stale.
+            else if (sub)
+                sub->summarized = false;
+            if (sub && !sub->summarized)
+                folder->summarized = false;
+        }
+        return count;
+    }
+    void readFilenameAttribute(Entry*& rt, char* attributeData) {
+        rt->parentPos = ((MFT_REFERENCE*)attributeData)->indx;
+        rt->size=  *(uint64_t*)(attributeData + 48);
+        rt->allocatedSize = *(uint64_t*)(attributeData + 40);
+        unsigned char size = *(uint8_t*)(attributeData + 64);
+        char16_t* name = (char16_t*)(attributeData + 66);
+        rt->name.assign(name, name + size);
+    }
+    void readStandardInfomationAttribute(Entry* rt, char* attributeData) {
+        rt->attribute.data = *(int32_t*)(attributeData + 32);
+        readTimes(attributeData, rt->creationTime, rt->lastModifiedTime,
+            rt->mftChangeTime, rt->lastAccessTime);
+    }
+    Entry* readMFTEntry(Entry* rt, uint64_t indx) {
+        AttributeIterator it(this, indx);
+        if (!it.valid())
+            return rt;
+        MFT_RECORD* header = (MFT_RECORD*)loadRecord(indx);
+        if (!rt) {
+            if (header->flags & 0x0002)
+                rt = new Folder;
+            else
+                rt = new File;
+        }
+        Folder* folder = dynamic_cast<Folder*>(rt);
+        File* file = dynamic_cast<File*>(rt);
+        // Only directories are ever checked by refresh.
+        if (folder)
+            catalog[indx] = { header->lsn, header->sequence_number };
+        if (file) {
+            free(file->dataPtr);
+            file->dataPtr = 0;
+        }
+        uint8_t fileNameSpace = 0xFF;
+        AttributeView view;
+        while (it.next(view)) {
+            switch (view.type()) {
+            case 0x00000010: //$STANDARD_INFORMATION
+                if (view.resident())
+                    readStandardInfomationAttribute(rt, view.value());
+                break;
+            case 0x00000030: //$FILE_NAME
+            {
+                // Prefer the long (win32/posix) name over the DOS one.
+                if (view.resident() &&
+                    (fileNameSpace == 0xFF || fileNameSpace == 2)) {
+                    uint64_t size = rt->size, allocated = rt->allocatedSize;
+                    readFilenameAttribute(rt, view.value());
+                    if (fileNameSpace != 0xFF) {
+                        rt->size = size;
+                        rt->allocatedSize = allocated;
+                    }
+                    fileNameSpace = *(uint8_t*)(view.value() + 65);
+                }
+            } break;
+            case 0x00000080: //$DATA
+                if (view.unnamed()) {
+                    if (view.resident())
+                        rt->size = view.valueLength();
+                    else if (view.attr->lowest_vcn == 0) {
+                        rt->size = view.attr->data_size;
+                        rt->allocatedSize = view.attr->allocated_size;
+                    }
+                    // Read it now, the view may point into a cache slot
+                    // that a later extension record reuses.
+                    if (file)
+                        readDataFragment(file, view);
+                }
+                break;
+            }
+        }
+        if (folder) {
+            folder->subEntries = readIndex(indx);
+            folder->loaded = true;
+        }
+        return rt;
+    }
+    // Read one fragment of a file's unnamed $DATA (there is more than one
+    // when $ATTRIBUTE_LIST split it over extension records) into dataPtr.
+    // The buffer is allocated by the fragment that gives the size, the
+    // resident one or the one at VCN 0.
+    void readDataFragment(File* file, const AttributeView& fragment) {
+        uint64_t size = file->size;
+        if (fragment.resident() || fragment.attr->lowest_vcn == 0) {
+            free(file->dataPtr);
+            file->dataPtr = calloc(size ? size : 1, 1);
+        }
+        char* buffer = (char*)file->dataPtr;
+        if (!buffer)
+            return;
+        if (fragment.resident()) {
+            memcpy(buffer, fragment.value(),
+                std::min<uint64_t>(size, fragment.valueLength()));
+            return;
+        }
+        uint64_t start = fragment.attr->lowest_vcn * geometry.clusterSize;
+        if (start < size)
+            readNonResident(fragment, buffer + start, size - start);
+    }
+    // On-demand access to the blocks of a directory's $INDEX_ALLOCATION.
+    // Blocks are read by VCN through the run list, fixed up once when they
+    // are loaded and kept in a bounded LRU cache. $BITMAP tells which
+    // blocks are in use, the others are never read.
+    class IndexAllocation {
+        struct Run {
+            uint64_t vcn, lcn, length;
+            bool sparse;
+        };
+        NTFS* fs;
+        std::vector<Run> runs;
+        std::vector<char> bitmap;
+        uint64_t blockSize, vcnSize;
+        typedef std::shared_ptr<std::vector<char>> Block;
+        std::list<std::pair<uint64_t, Block>> cache;
+
+        bool readStream(uint64_t offset, char* buffer, uint64_t size) {
+            uint64_t clusterSize = fs->geometry.clusterSize;
+            uint64_t done = 0;
+            for (const Run& run : runs) {
+                uint64_t runStart = run.vcn * clusterSize;
+                uint64_t runEnd = runStart + run.length * clusterSize;
+                uint64_t from = std::max(offset + done, runStart);
+                uint64_t to = std::min(offset + size, runEnd);
+                if (from >= to || from != offset + done)
+                    continue;
+                if (run.sparse)
+                    memset(buffer + done, 0, to - from);
+                else if (!fs->read(buffer + done,
+                    run.lcn * clusterSize + (from - runStart), to - from))
+                    return false;
+                done += to - from;
+            }
+            return done == size;
+        }
+
+    public:
+        static const size_t cacheBlocks = 64;
+        IndexAllocation(NTFS* fs, uint64_t blockSize)
+            : fs(fs), blockSize(blockSize) {
+            uint64_t clusterSize = fs->geometry.clusterSize;
+            // Blocks smaller than a cluster are addressed in 512 byte units.
+            vcnSize = blockSize >= clusterSize ? clusterSize : 512;
+        }
+        bool empty() { return runs.empty(); }
+        void addRuns(const AttributeView& fragment) {
+            uint64_t vcn = fragment.attr->lowest_vcn, length, lcn;
+            bool sparse;
+            RunListReader reader = fragment.runs();
+            while (reader.next(length, lcn, sparse)) {
+                runs.push_back({ vcn, lcn, length, sparse });
+                vcn += length;
+            }
+        }
+        void setBitmap(const AttributeView& view) {
+            if (view.resident())
+                bitmap.assign(view.value(), view.value() + view.valueLength());
+            else {
+                bitmap.resize(view.attr->data_size);
+                if (!fs->readNonResident(view, bitmap.data(), bitmap.size()))
+                    bitmap.clear();
+            }
+        }
+        bool inUse(uint64_t vcn) {
+            uint64_t indx = vcn * vcnSize / blockSize;
+            if (bitmap.empty())
+                return true;
+            return indx / 8 < bitmap.size() &&
+                (bitmap[indx / 8] >> (indx % 8) & 1);
+        }
+        // The block is shared with the cache, so it stays valid for the
+        // caller even if the cache drops it meanwhile.
+        Block block(uint64_t vcn) {
+            for (auto it = cache.begin(); it != cache.end(); ++it)
+                if (it->first == vcn) {
+                    cache.splice(cache.begin(), cache, it);
+                    return it->second;
+                }
+            if (!inUse(vcn))
+                return 0;
+            Block b = std::make_shared<std::vector<char>>(blockSize);
+            if (!readStream(vcn * vcnSize, b->data(), blockSize) ||
+                memcmp(b->data(), "INDX", 4) != 0 ||
+                !fs->restoreFixup(b->data(), blockSize))
+                return 0;
+            cache.push_front({ vcn, b });
+            if (cache.size() > cacheBlocks)
+                cache.pop_back();
+            return b;
+        }
+    };
+
+    // Find the $I30 index of a directory record. Returns the resident
+    // $INDEX_ROOT and sets up alloc with the $INDEX_ALLOCATION runs and
+    // $BITMAP, without reading any index block yet.
+    // The $INDEX_ROOT is copied into rootData: records loaded while the
+    // index is walked may reuse the cache slot it was read into.
+    INDEX_ROOT* openIndex(uint64_t indx, IndexAllocation*& alloc,
+        std::vector<char>& rootData) {
+        static const char16_t I30[] = { '$', 'I', '3', '0' };
+        AttributeIterator it(this, indx);
+        AttributeView view;
+        INDEX_ROOT* root = 0;
+        alloc = 0;
+        while (it.next(view)) {
+            if (!view.named(I30, 4))
+                continue;
+            if (view.type() == 0x90 && view.resident() &&
+                view.valueLength() >= sizeof(INDEX_ROOT)) { //$INDEX_ROOT
+                rootData.assign(view.value(),
+                    view.value() + view.valueLength());
+                root = (INDEX_ROOT*)rootData.data();
+                if (!alloc)
+                    alloc = new IndexAllocation(this,
+                        root->index_block_size);
+            }
+            else if (view.type() == 0xa0 && !view.resident()) {
+                if (!alloc) //$INDEX_ALLOCATION
+                    alloc = new IndexAllocation(this, index_block_size);
+                alloc->addRuns(view);
+            }
+            else if (view.type() == 0xb0) { //$BITMAP
+                if (!alloc)
+                    alloc = new IndexAllocation(this, index_block_size);
+                alloc->setBitmap(view);
+            }
+        }
+        if (!root) {
+            delete alloc;
+            alloc = 0;
+        }
+        return root;
+    }
+    // Walk a B+ tree index node in key order, descending into child blocks
+    // as they are reached. visit returns false to stop the walk.
+    bool walkIndex(INDEX_HEADER* header, uint64_t space,
+        IndexAllocation* alloc, const std::function<bool(INDEX_ENTRY*)>& visit,
+        int depth = 0) {
+        if (depth > 32 || header->index_length > space)
+            return true;
+        char* end = (char*)header + header->index_length;
+        for (char* p = (char*)header + header->entries_offset;
+            p + sizeof(INDEX_ENTRY) <= end;) {
+            INDEX_ENTRY* i = (INDEX_ENTRY*)p;
+            if (i->length < sizeof(INDEX_ENTRY) || p + i->length > end)
+                break;
+            if ((i->ie_flags & 1) && alloc && !alloc->empty()) {
+                uint64_t vcn = *(uint64_t*)(p + i->length - 8);
+                auto block = alloc->block(vcn);
+                if (block) {
+                    INDEX_ALLOCATION* node = (INDEX_ALLOCATION*)block->data();
+                    if (!walkIndex(&node->index,
+                        block->size() - offsetof(INDEX_ALLOCATION, index),
+                        alloc, visit, depth + 1))
+                        return false;
+                }
+            }
+            if (i->ie_flags & 2)
+                break;
+            if (i->key_length > 0 && !visit(i))
+                return false;
+            p += i->length;
+        }
+        return true;
+    }
+    // The kind of entry an index key (a copy of the $FILE_NAME attribute)
+    // describes: 0 for a DOS-only name, else 'D', 'T' or 'F'.
+    static char indexEntryKind(INDEX_ENTRY* i) {
+        char* fileName = (char*)i + sizeof(INDEX_ENTRY);
+        if (*(uint8_t*)(fileName + 65) == 2)
+            return 0;
+        if (*(uint32_t*)(fileName + 56) & 0x10000000)
+            return 'D';
+        uint8_t length = *(uint8_t*)(fileName + 64);
+        char16_t* name = (char16_t*)(fileName + 66);
+        if (length >= 4 && name[length - 4] == '.' &&
+            towlower(name[length - 3]) == L't' &&
+            towlower(name[length - 2]) == L'x' &&
+            towlower(name[length - 1]) == L't')
+            return 'T';
+        return 'F';
+    }
+    // Fill e from an index key, false for metafiles.
+    bool readIndexEntry(Entry* e, INDEX_ENTRY* i) {
+        char* fileName = (char*)i + sizeof(INDEX_ENTRY);
+        readFilenameAttribute(e, fileName);
+        readTimes(fileName + 8, e->creationTime, e->lastModifiedTime,
+            e->mftChangeTime, e->lastAccessTime);
+        e->attribute.data = *(int32_t*)(fileName + 56);
+        e->pos = i->indexed_file.indx;
+        return !e->name.empty() && e->name[0] != L'$';
+    }
+    // Build an entry from an index key. DOS-only names and metafiles are
+    // skipped.
+    Entry* newIndexEntry(INDEX_ENTRY* i) {
+        Entry* e;
+        switch (indexEntryKind(i)) {
+        case 'D': e = new Folder; break;
+        case 'T': e = new TXT; break;
+        case 'F': e = new File; break;
+        default: return 0;
+        }
+        if (!readIndexEntry(e, i)) {
+            delete e;
+            return 0;
+        }
+        return e;
+    }
+    std::vector<Entry*> readIndex(uint64_t indx) {
+        std::vector<Entry*> rt;
+        IndexAllocation* alloc;
+        std::vector<char> rootData;
+        INDEX_ROOT* root = openIndex(indx, alloc, rootData);
+        if (root)
+            walkIndex(&root->index, rootData.size() - 16, alloc,
+                [&](INDEX_ENTRY* i) {
+                    if (Entry* e = newIndexEntry(i))
+                        rt.push_back(e);
+                    return true;
+                });
+        delete alloc;
+        return rt;
+    }
+    void getData(Entry* entry) { 
+        if (dynamic_cast<TXT*>(entry)||dynamic_cast<Folder*>(entry))
+        readMFTEntry(entry, entry->pos); }
+    // The size recorded in $DATA. The copy of $FILE_NAME in the parent's
+    // index, which listings take the size from, is often stale.
+    uint64_t fileSize(Entry* e) {
+        std::lock_guard<std::mutex> l(metadataLock);
+        AttributeIterator it(this, e->pos, 0x80);
+        AttributeView view;
+        while (it.next(view)) {
+            if (!view.unnamed())
+                continue;
+            if (view.resident())
+                return view.valueLength();
+            if (view.attr->lowest_vcn == 0)
+                return view.attr->data_size;
+        }
+        return e->size;
+    }
+    // Only the runs of $DATA that overlap the range are read, wherever in
+    // the run list they are. The end of the file is taken from $DATA.
+    uint64_t readFile(Entry* e, uint64_t offset, void* buffer, uint64_t size) {
+        char* out = (char*)buffer;
+        memset(out, 0, size); // sparse runs read as zeroes
+        uint64_t dataSize = e->size;
+        std::vector<ReadRequest> runs;
+        std::unique_lock<std::mutex> l(metadataLock);
+        AttributeIterator it(this, e->pos, 0x80);
+        AttributeView view;
+        while (it.next(view)) {
+            if (!view.unnamed())
+                continue;
+            if (view.resident()) {
+                dataSize = view.valueLength();
+                if (offset < dataSize)
+                    memcpy(out, view.value() + offset,
+                        std::min<uint64_t>(size, dataSize - offset));
+                continue;
+            }
+            if (view.attr->lowest_vcn == 0)
+                dataSize = view.attr->data_size;
+            geometry.withClusterSize([&](auto clusterSize) {
+                uint64_t vcn = view.attr->lowest_vcn, length, lcn;
+                bool sparse;
+                RunListReader reader = view.runs();
+                while (reader.next(length, lcn, sparse)) {
+                    uint64_t runStart = clusterSize.bytes(vcn);
+                    uint64_t runEnd = runStart + clusterSize.bytes(length);
+                    vcn += length;
+                    if (runEnd <= offset || sparse)
+                        continue;
+                    if (runStart >= offset + size)
+                        break;
+                    uint64_t from = std::max(runStart, offset);
+                    uint64_t to = std::min(runEnd, offset + size);
+                    runs.push_back({ out + (from - offset),
+                        clusterSize.bytes(lcn) + (from - runStart), to - from,
+                        false });
+                }
+            });
+        }
+        l.unlock();
+        if (offset >= dataSize)
+            return 0;
+        size = std::min(size, dataSize - offset);
+        // The range asked for may reach past the end of the data.
+        std::vector<ReadRequest> inFile;
+        for (ReadRequest& r : runs) {
+            uint64_t at = (char*)r.buffer - out;
+            if (at < size)
+                inFile.push_back({ r.buffer, r.pos, std::min(r.size, size - at),
+                    false });
+        }
+        return readBatch(inFile) ? size : 0;
+    }
+    // Scan the MFT linearly instead of walking the directories: every base
+    // record in use gives a $STANDARD_INFORMATION and a $FILE_NAME record.
+    uint64_t mftRecordCount() {
+        uint64_t clusters = 0;
+        for (auto& run : mftRuns)
+            clusters += run.second;
+        return clusters * geometry.clusterSize / geometry.recordSize;
+    }
+    // Linear scans read the MFT a window of records ahead through readBatch,
+    // one request per contiguous piece of the window, rather than one
+    // cached block at a time. Records outside the window are read as usual.
+    static constexpr uint64_t scanWindowSize = 4 * 1024 * 1024;
+    void scanAhead(uint64_t indx, uint64_t records) {
+        if (indx - scanFirst < scanCount)
+            return;
+        uint64_t recordSize = geometry.recordSize;
+        uint64_t count = std::min(records - indx,
+            std::max<uint64_t>(1, scanWindowSize / recordSize));
+        scanBuffer.resize(count * recordSize);
+        std::vector<ReadRequest> requests;
+        for (uint64_t i = 0; i < count;) {
+            uint64_t pos = mftRecordOffset(indx + i), n = 1;
+            while (i + n < count &&
+                mftRecordOffset(indx + i + n) == pos + n * recordSize)
+                n++;
+            requests.push_back({ scanBuffer.data() + i * recordSize, pos,
+                n * recordSize, false });
+            i += n;
+        }
+        scanFirst = indx;
+        scanCount = readBatch(requests) ? count : 0;
+    }
+    void endScan() {
+        scanCount = 0;
+        std::vector<char>().swap(scanBuffer);
+    }
+    // Every non-resident attribute of every file in use, found by scanning
+    // the MFT linearly. Runs in extension records belong to the base record.
+    void collectExtents(const std::function<void(uint64_t first, uint64_t count,
+        uint64_t owner, const wchar_t* what)>& visit) {
+        uint64_t records = mftRecordCount();
+        for (uint64_t indx = 0; indx < records; indx++) {
+            scanAhead(indx, records);
+            MFT_RECORD* header = (MFT_RECORD*)loadRecord(indx);
+            if (!header || !(header->flags & 0x0001) ||
+                header->base_mft_record.indx != 0)
+                continue;
+            AttributeIterator it(this, indx);
+            AttributeView view;
+            while (it.next(view)) {
+                if (view.resident())
+                    continue;
+                const wchar_t* what = L"attribute";
+                switch (view.type()) {
+                case 0x20: what = L"$ATTRIBUTE_LIST"; break;
+                case 0x80: what = L"$DATA"; break;
+                case 0xA0: what = L"$INDEX_ALLOCATION"; break;
+                case 0xB0: what = L"$BITMAP"; break;
+                }
+                uint64_t length, lcn;
+                bool sparse;
+                RunListReader reader = view.runs();
+                while (reader.next(length, lcn, sparse))
+                    if (!sparse)
+                        visit(lcn, length, indx, what);
+            }
+        }
+        endScan();
+    }
+    void collectTimes(const std::function<void(const TimeRecord&)>& visit) {
+        uint64_t records = mftRecordCount();
+        for (uint64_t indx = 0; indx < records; indx++) {
+            scanAhead(indx, records);
+            MFT_RECORD* header = (MFT_RECORD*)loadRecord(indx);
+            if (!header || !(header->flags & 0x0001) ||
+                header->base_mft_record.indx != 0)
+                continue;
+            TimeRecord si = { indx, indx, indx, L"", 0, 0, 0, 0, 0,
+                TimeRecord::StandardInformation,
+                (header->flags & 0x0002) != 0 };
+            TimeRecord fn = si;
+            fn.source = TimeRecord::FileName;
+            bool hasSize = false, hasSI = false;
+            uint8_t fileNameSpace = 0xFF;
+            AttributeIterator it(this, indx);
+            AttributeView view;
+            while (it.next(view)) {
+                if (view.type() == 0x80 && view.unnamed() && !hasSize) {
+                    if (view.resident())
+                        si.size = view.valueLength();
+                    else if (view.attr->lowest_vcn == 0)
+                        si.size = view.attr->data_size;
+                    hasSize = true;
+                }
+                if (!view.resident())
+                    continue;
+                if (view.type() == 0x10) { //$STANDARD_INFORMATION
+                    readTimes(view.value(), si.created, si.modified,
+                        si.changed, si.accessed);
+                    hasSI = true;
+                }
+                // Prefer the long (win32/posix) name over the DOS one.
+                else if (view.type() == 0x30 &&
+                    (fileNameSpace == 0xFF || fileNameSpace == 2)) {
+                    char* value = view.value();
+                    fn.parent = ((MFT_REFERENCE*)value)->indx;
+                    char16_t* name = (char16_t*)(value + 66);
+                    fn.name.assign(name, name + *(uint8_t*)(value + 64));
+                    fn.size = *(uint64_t*)(value + 48);
+                    readTimes(value + 8, fn.created, fn.modified, fn.changed,
+                        fn.accessed);
+                    fileNameSpace = *(uint8_t*)(value + 65);
+                }
+            }
+            si.parent = fn.parent;
+            si.name = fn.name;
+            if (!hasSize)
+                si.size = fn.size;
+            fn.size = si.size;
+            if (hasSI)
+                visit(si);
+            if (fileNameSpace != 0xFF)
+                visit(fn);
+        }
+        endScan();
+    }
+    // Stream a directory straight from its index, reading index blocks only
+    // as far as the caller keeps going. One entry of each kind is reused for
+    // all of them, so nothing is allocated per entry.
+    void enumerate(Folder* folder, const std::function<bool(Entry*)>& visit) {
+        if (folder->loaded) {
+            Filesystem::enumerate(folder, visit);
+            return;
+        }
+        Folder subFolder;
+        File file;
+        TXT text;
+        IndexAllocation* alloc;
+        std::vector<char> rootData;
+        INDEX_ROOT* root = openIndex(folder->pos, alloc, rootData);
+        if (root)
+            walkIndex(&root->index, rootData.size() - 16, alloc,
+                [&](INDEX_ENTRY* i) {
+                    Entry* e;
+                    switch (indexEntryKind(i)) {
+                    case 'D': e = &subFolder; break;
+                    case 'T': e = &text; break;
+                    case 'F': e = &file; break;
+                    default: return true;
+                    }
+                    return !readIndexEntry(e, i) || visit(e);
+                });
+        delete alloc;
+    }
+    int refresh() {
+        disk->invalidate();
+        dropRecordCache();
+        cache->dropFiles();
+        return refreshFolder(rootDirectory);
+    }
+};
+
+// Sorts more items than fit in memory. Items are collected up to a memory
+// budget, sorted in parallel and spilled to a temporary file as a sorted
+// run; reading them back merges the runs. T must be trivially copyable.
+template <class T, class Less = std::less<T>> class ExternalSorter {
+    Less less;
+    size_t capacity;
+    std::vector<T> buffer;
+    size_t bufferPos;
+    struct Run {
+        FILE* file; // 0 for the run kept in memory, all of it in block
+        std::vector<T> block;
+        size_t pos, size;
+    };
+    std::vector<Run> runs;
+    // Smallest pending item of every run, as (item, run).
+    struct Greater {
+        Less less;
+        bool operator()(const std::pair<T, size_t>& a,
+            const std::pair<T, size_t>& b) const {
+            return less(b.first, a.first);
+        }
+    };
+    std::priority_queue<std::pair<T, size_t>,
+        std::vector<std::pair<T, size_t>>, Greater> heap;
+
+    // Sort slices of the buffer on all cores, then merge neighbouring
+    // slices pairwise, also in parallel, until one is left.
+    void parallelSort() {
+        size_t parts = std::max(1u, std::thread::hardware_concurrency());
+        parts = std::min(parts, buffer.size() / 4096 + 1);
+        std::vector<size_t> bounds;
+        for (size_t i = 0; i <= parts; i++)
+            bounds.push_back(buffer.size() * i / parts);
+        auto at = [&](size_t i) { return buffer.begin() + bounds[i]; };
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < parts; i++)
+            workers.emplace_back([&, i] { std::sort(at(i), at(i + 1), less); });
+        for (std::thread& t : workers)
+            t.join();
+        for (size_t width = 1; width < parts; width *= 2) {
+            workers.clear();
+            for (size_t i = 0; i + width < parts; i += 2 * width)
+                workers.emplace_back([&, i, width] {
+                    inplace_merge(at(i), at(i + width),
+                        at(std::min(i + 2 * width, parts)), less);
+                });
+            for (std::thread& t : workers)
+                t.join();
+        }
+    }
+    void spill() {
+        parallelSort();
+        FILE* file = tmpfile();
+        if (!file ||
+            fwrite(buffer.data(), sizeof(T), buffer.size(), file) !=
+            buffer.size()) {
+            if (file)
+                fclose(file);
+            capacity *= 2; // no room on disk, keep going in memory
+            return;
+        }
+        rewind(file);
+        runs.push_back({ file, std::vector<T>(), 0, 0 });
+        buffer.clear();
+    }
+    bool refill(Run& run) {
+        if (!run.file)
+            return false;
+        run.size = fread(run.block.data(), sizeof(T), run.block.size(),
+            run.file);
+        run.pos = 0;
+        return run.size != 0;
+    }
+
+public:
+    ExternalSorter(uint64_t budget, Less less = Less())
+        : less(less), capacity(std::max<uint64_t>(budget / sizeof(T), 1024)),
+        bufferPos(0), heap(Greater{ less }) {}
+    ~ExternalSorter() {
+        for (Run& run : runs)
+            if (run.file)
+                fclose(run.file);
+    }
+    void push(const T& item) {
+        buffer.push_back(item);
+        if (buffer.size() >= capacity)
+            spill();
+    }
+    // Done pushing, sort what is left and get ready to read back.
+    void finish() {
+        if (runs.empty()) {
+            parallelSort();
+            return;
+        }
+        if (!buffer.empty())
+            spill();
+        if (!buffer.empty()) { // the last spill failed, merge it from memory
+            runs.push_back({ 0, std::move(buffer), 0, 0 });
+            runs.back().size = runs.back().block.size();
+        }
+        std::vector<T>().swap(buffer);
+        size_t blockItems = std::max<size_t>(capacity / runs.size(), 1024);
+        for (size_t i = 0; i < runs.size(); i++) {
+            if (runs[i].file)
+                runs[i].block.resize(blockItems);
+            if (!runs[i].file ? runs[i].size != 0 : refill(runs[i]))
+                heap.push({ runs[i].block[runs[i].pos++], i });
+        }
+    }
+    bool next(T& item) {
+        if (runs.empty()) {
+            if (bufferPos == buffer.size())
+                return false;
+            item = buffer[bufferPos++];
+            return true;
+        }
+        if (heap.empty())
+            return false;
+        item = heap.top().first;
+        size_t i = heap.top().second;
+        heap.pop();
+        Run& run = runs[i];
+        if (run.pos < run.size || refill(run))
+            heap.push({ run.block[run.pos++], i });
+        return true;
+    }
+};
+
+// Names of the entries of a volume by id, to build full paths from the
+// parents in TimeRecords.
+class PathTable {
+    struct Name {
+        uint64_t parent;
+        std::wstring name;
+        bool known;
+    };
+    std::vector<Name> names;
+
+public:
+    void add(const TimeRecord& r) {
+        if (r.id >= names.size())
+            names.resize(std::max<uint64_t>(r.id + 1, names.size() * 2));
+        if (!names[r.id].known)
+            names[r.id] = { r.parent, r.name, true };
+    }
+    std::wstring path(uint64_t id) {
+        std::vector<const std::wstring*> parts;
+        for (int depth = 0; id < names.size() && names[id].known &&
+            names[id].parent != id && depth < 1024; depth++) {
+            parts.push_back(&names[id].name);
+            id = names[id].parent;
+        }
+        std::wstring rt;
+        for (auto it = parts.rbegin(); it != parts.rend(); ++it)
+            rt += L"/" + **it;
+        return rt.empty() ? L"/" : rt;
+    }
+};
+
+// Writes a MAC(B) timeline of a volume, either as CSV events sorted by
+// time or as a bodyfile (one line per file and source, for mactime). Only
+// the names of the files are kept in memory, events go through an
+// ExternalSorter.
+class Timeline {
+    PathTable names;
+    struct Event {
+        int64_t time;
+        uint64_t id, size;
+        uint8_t macb, source;
+        bool operator<(const Event& o) const {
+            return time != o.time ? time < o.time : id < o.id;
+        }
+    };
+    struct Body {
+        uint64_t id, size;
+        int64_t modified, accessed, changed, created;
+        uint8_t source;
+        bool directory;
+        bool operator<(const Body& o) const {
+            return id != o.id ? id < o.id : source < o.source;
+        }
+    };
+    FILE* out;
+
+    void print(const std::string& text) {
+        fwrite(text.data(), 1, text.size(), out);
+    }
+    static std::string formatTime(int64_t time) {
+        time_t t = time;
+        char text[32] = "";
+        if (tm* utc = gmtime(&t))
+            strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", utc);
+        return text;
+    }
+    static const char* sourceName(uint8_t source) {
+        static const char* names[] = { "dirent", "$SI", "$FN" };
+        return names[source];
+    }
+
+public:
+    static constexpr uint64_t sortMemory = 64 << 20;
+    Timeline(FILE* out) : out(out) {}
+    uint64_t writeCSV(Filesystem* fs) {
+        ExternalSorter<Event> events(sortMemory);
+        fs->collectTimes([&](const TimeRecord& r) {
+            names.add(r);
+            // One event per distinct time, with the activities that share it.
+            time_t times[] = { r.modified, r.accessed, r.changed, r.created };
+            for (int i = 0; i < 4; i++) {
+                if (times[i] == 0)
+                    continue;
+                bool first = true;
+                for (int j = 0; j < i; j++)
+                    first &= times[j] != times[i];
+                if (!first)
+                    continue;
+                uint8_t macb = 0;
+                for (int j = i; j < 4; j++)
+                    if (times[j] == times[i])
+                        macb |= 1 << j;
+                events.push({ times[i], r.id, r.size, macb,
+                    uint8_t(r.source) });
+            }
+        });
+        events.finish();
+        print("Date,Size,Activity,Source,Name\n");
+        Event e;
+        uint64_t count = 0;
+        while (events.next(e)) {
+            std::string activity = "macb";
+            for (int j = 0; j < 4; j++)
+                if (!(e.macb & (1 << j)))
+                    activity[j] = '.';
+            std::string name = Utility::toUTF8(names.path(e.id));
+            for (size_t q = 0; (q = name.find('"', q)) != std::string::npos;
+                q += 2)
+                name.insert(q, 1, '"');
+            print(formatTime(e.time) + "," + std::to_string(e.size) + "," +
+                activity + "," + sourceName(e.source) + ",\"" + name +
+                "\"\n");
+            count++;
+        }
+        return count;
+    }
+    uint64_t writeBodyfile(Filesystem* fs) {
+        ExternalSorter<Body> bodies(sortMemory);
+        fs->collectTimes([&](const TimeRecord& r) {
+            names.add(r);
+            bodies.push({ r.id, r.size, r.modified, r.accessed, r.changed,
+                r.created, uint8_t(r.source), r.directory });
+        });
+        bodies.finish();
+        Body b;
+        uint64_t count = 0;
+        while (bodies.next(b)) {
+            // MD5|name|inode|mode|UID|GID|size|atime|mtime|ctime|crtime
+            print("0|" + Utility::toUTF8(names.path(b.id)) +
+                (b.source == TimeRecord::FileName ? " ($FILE_NAME)" : "") +
+                "|" + std::to_string(b.id) + "|" +
+                (b.directory ? "d/drwxrwxrwx" : "r/rrwxrwxrwx") + "|0|0|" +
+                std::to_string(b.size) + "|" +
+                std::to_string(b.accessed) + "|" +
+                std::to_string(b.modified) + "|" +
+                std::to_string(b.changed) + "|" +
+                std::to_string(b.created) + "\n");
+            count++;
+        }
+        return count;
+    }
+};
+
+// Streaming XXH64 (64 bit non-cryptographic hash).
+class Hash64 {
+    static constexpr uint64_t p1 = 11400714785074694791ULL,
+        p2 = 14029467366897019727ULL, p3 = 1609587929392839161ULL,
+        p4 = 9650029242287828579ULL, p5 = 2870177450012600261ULL;
+    uint64_t v[4], total;
+    uint8_t stripe[32];
+    size_t stripeSize;
+
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t round(uint64_t acc, uint64_t input) {
+        return rotl(acc + input * p2, 31) * p1;
+    }
+    static uint64_t merge(uint64_t acc, uint64_t value) {
+        return (acc ^ round(0, value)) * p1 + p4;
+    }
+    static uint64_t read64(const uint8_t* p) {
+        uint64_t value;
+        memcpy(&value, p, 8);
+        return value;
+    }
+    static uint32_t read32(const uint8_t* p) {
+        uint32_t value;
+        memcpy(&value, p, 4);
+        return value;
+    }
+    void consume(const uint8_t* p) {
+        for (int i = 0; i < 4; i++)
+            v[i] = round(v[i], read64(p + 8 * i));
+    }
+
+public:
+    Hash64() : v{ p1 + p2, p2, 0, 0 - p1 }, total(0), stripeSize(0) {}
+    void update(const void* data, size_t size) {
+        const uint8_t *p = (const uint8_t*)data, *end = p + size;
+        total += size;
+        if (stripeSize) {
+            size_t take = std::min(size, 32 - stripeSize);
+            memcpy(stripe + stripeSize, p, take);
+            stripeSize += take;
+            p += take;
+            if (stripeSize < 32)
+                return;
+            consume(stripe);
+            stripeSize = 0;
+        }
+        for (; end - p >= 32; p += 32)
+            consume(p);
+        memcpy(stripe, p, end - p);
+        stripeSize = end - p;
+    }
+    uint64_t digest() const {
+        uint64_t h;
+        if (total >= 32) {
+            h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+            for (int i = 0; i < 4; i++)
+                h = merge(h, v[i]);
+        }
+        else
+            h = v[2] + p5;
+        h += total;
+        const uint8_t *p = stripe, *end = stripe + stripeSize;
+        for (; end - p >= 8; p += 8)
+            h = rotl(h ^ round(0, read64(p)), 27) * p1 + p4;
+        if (end - p >= 4) {
+            h = rotl(h ^ (read32(p) * p1), 23) * p2 + p3;
+            p += 4;
+        }
+        for (; p < end; p++)
+            h = rotl(h ^ (*p * p5), 11) * p1;
+        h ^= h >> 33;
+        h *= p2;
+        h ^= h >> 29;
+        h *= p3;
+        return h ^ (h >> 32);
+    }
+};
+
+// Finds files with the same content on a set of volumes in three stages,
+// each only for the files that still collide after the previous one: equal
+// size (metadata only), equal hash of the first and last block, equal hash
+// of the whole file.
+class DuplicateFinder {
+public:
+    struct Candidate {
+        uint32_t volume;
+        uint64_t id, pos, size, hash;
+        bool complete; // hash covers the whole file
+    };
+    static constexpr uint64_t edgeSize = 4096;
+    static constexpr uint64_t chunkSize = 1 << 20;
+    uint64_t files, partiallyRead, fullyRead;
+
+private:
+    std::vector<Filesystem*> volumes;
+    std::vector<PathTable> names;
+    std::vector<Candidate> candidates;
+
+    // Run job on every candidate, on all cores. Each worker has its own
+    // read buffer.
+    template <class F> void forEach(F job) {
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> workers;
+        unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned t = 0; t < threads; t++)
+            workers.emplace_back([&] {
+                std::vector<char> buffer(chunkSize);
+                for (size_t i; (i = next++) < candidates.size();)
+                    job(candidates[i], buffer);
+            });
+        for (std::thread& t : workers)
+            t.join();
+    }
+    static uint64_t read(Filesystem* fs, const Candidate& c, uint64_t offset,
+        char* buffer, uint64_t size) {
+        File file;
+        file.pos = c.pos;
+        file.size = c.size;
+        return fs->readFile(&file, offset, buffer, size);
+    }
+    // Keep only candidates that share size and hash with another one, in
+    // groups next to each other.
+    void keepCollisions() {
+        std::sort(candidates.begin(), candidates.end(),
+            [](const Candidate& a, const Candidate& b) {
+                if (a.size != b.size)
+                    return a.size > b.size;
+                if (a.hash != b.hash)
+                    return a.hash < b.hash;
+                return a.volume != b.volume ? a.volume < b.volume : a.id < b.id;
+            });
+        std::vector<Candidate> kept;
+        for (size_t i = 0, j; i < candidates.size(); i = j) {
+            for (j = i + 1; j < candidates.size() &&
+                candidates[j].size == candidates[i].size &&
+                candidates[j].hash == candidates[i].hash;
+                j++)
+                ;
+            if (j - i > 1)
+                kept.insert(kept.end(), candidates.begin() + i,
+                    candidates.begin() + j);
+        }
+        candidates.swap(kept);
+    }
+
+public:
+    DuplicateFinder(const std::vector<Filesystem*>& volumes)
+        : files(0), partiallyRead(0), fullyRead(0), volumes(volumes),
+        names(volumes.size()) {}
+    void run() {
+        for (uint32_t v = 0; v < volumes.size(); v++)
+            volumes[v]->collectTimes([&](const TimeRecord& r) {
+                names[v].add(r);
+                if (r.source == TimeRecord::FileName || r.directory ||
+                    r.size == 0 || r.name.empty() || r.name[0] == L'$')
+                    return;
+                files++;
+                candidates.push_back({ v, r.id, r.pos, r.size, 0, false });
+            });
+        keepCollisions(); // by size alone
+        partiallyRead = candidates.size();
+        forEach([&](Candidate& c, std::vector<char>& buffer) {
+            Hash64 hash;
+            uint64_t head = std::min(c.size, edgeSize);
+            hash.update(buffer.data(),
+                read(volumes[c.volume], c, 0, buffer.data(), head));
+            if (c.size > head) {
+                uint64_t tail = std::min(c.size - head, edgeSize);
+                hash.update(buffer.data(), read(volumes[c.volume], c,
+                    c.size - tail, buffer.data(), tail));
+            }
+            c.hash = hash.digest();
+            c.complete = c.size <= 2 * edgeSize;
+        });
+        keepCollisions();
+        forEach([&](Candidate& c, std::vector<char>& buffer) {
+            if (c.complete)
+                return;
+            Hash64 hash;
+            for (uint64_t offset = 0; offset < c.size;) {
+                uint64_t got = read(volumes[c.volume], c, offset,
+                    buffer.data(), std::min(chunkSize, c.size - offset));
+                if (got == 0)
+                    break;
+                hash.update(buffer.data(), got);
+                offset += got;
+            }
+            c.hash = hash.digest();
+            c.complete = true;
+        });
+        for (const Candidate& c : candidates)
+            fullyRead += c.size > 2 * edgeSize;
+        keepCollisions();
+    }
+    // The duplicates, grouped: a group is a run of candidates with the same
+    // size and hash.
+    const std::vector<Candidate>& duplicates() { return candidates; }
+    std::wstring path(const Candidate& c) { return names[c.volume].path(c.id); }
+};
+
+// Reverse map from clusters to the entries owning them: the extents of all
+// files in a table sorted by first cluster, looked up by binary search.
+class ClusterMap {
+public:
+    struct Extent {
+        uint64_t first, count, owner;
+        const wchar_t* what;
+    };
+
+private:
+    std::vector<Extent> extents;
+    PathTable names;
+    std::unordered_map<uint64_t, uint64_t> idByPos;
+
+public:
+    void build(Filesystem* fs) {
+        fs->collectExtents([&](uint64_t first, uint64_t count, uint64_t owner,
+            const wchar_t* what) {
+                extents.push_back({ first, count, owner, what });
+            });
+        std::sort(extents.begin(), extents.end(),
+            [](const Extent& a, const Extent& b) { return a.first < b.first; });
+        // Join runs of the same stream that follow each other on disk.
+        std::vector<Extent> joined;
+        for (const Extent& e : extents)
+            if (!joined.empty() && joined.back().owner == e.owner &&
+                joined.back().what == e.what &&
+                joined.back().first + joined.back().count == e.first)
+                joined.back().count += e.count;
+            else
+                joined.push_back(e);
+        extents.swap(joined);
+        extents.shrink_to_fit();
+        fs->collectTimes([&](const TimeRecord& r) {
+            names.add(r);
+            idByPos.emplace(r.pos, r.id);
+        });
+    }
+    size_t size() { return extents.size(); }
+    // The extents overlapping clusters [first, first + count).
+    std::vector<Extent> find(uint64_t first, uint64_t count) {
+        std::vector<Extent> rt;
+        auto it = std::upper_bound(extents.begin(), extents.end(), first,
+            [](uint64_t cluster, const Extent& e) { return cluster < e.first; });
+        if (it != extents.begin() &&
+            std::prev(it)->first + std::prev(it)->count > first)
+            --it;
+        for (; it != extents.end() && it->first < first + count; ++it)
+            rt.push_back(*it);
+        return rt;
+    }
+    std::wstring describe(const Extent& e) {
+        std::wstring rt;
+        auto id = idByPos.find(e.owner);
+        if (e.owner == UINT64_MAX)
+            rt = e.what;
+        else if (id == idByPos.end())
+            rt = L"(no entry, chain at " + std::to_wstring(e.owner) + L")";
+        else {
+            rt = names.path(id->second);
+            if (*e.what)
+                rt += L" (" + std::wstring(e.what) + L")";
+        }
+        return rt + L", clusters " + std::to_wstring(e.first) + L"-" +
+            std::to_wstring(e.first + e.count - 1);
+    }
+};
+
+struct Volume {
+    Filesystem* fs;
+    std::wstring name;
+};
+
+// Opens the supported filesystems of a disk or image.
+class Volumes {
+public:
+    // The filesystem starting at offset, 0 if there is none we can read.
+    static Filesystem* mount(std::shared_ptr<Disk> disk, uint64_t offset) {
+        char firstSector[512];
+        if (!disk->read(firstSector, offset, 512))
+            return 0;
+        Filesystem* fs = 0;
+        if (strncmp(firstSector + 0x52, "FAT32", 5) == 0)
+            fs = new FAT32(disk, offset);
+        else if (strncmp(firstSector + 3, "NTFS", 4) == 0)
+            fs = new NTFS(disk, offset);
+        if (fs && !fs->rootDirectory) {
+            delete fs;
+            fs = 0;
+        }
+        return fs;
+    }
+    // Mount the disk as a single volume, or every supported partition on
+    // it. Partitions are mounted in parallel and share the disk's cache.
+    // The caller owns the returned filesystems.
+    static std::vector<Volume> mountAll(std::shared_ptr<Disk> disk,
+        const std::wstring& diskPath) {
+        std::vector<Volume> volumes;
+        if (Filesystem* single = mount(disk, 0)) {
+            volumes.push_back({ single, diskPath });
+            return volumes;
+        }
+        std::vector<Partition> partitions = PartitionTable::read(*disk);
+        std::vector<Filesystem*> mounted(partitions.size());
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < partitions.size(); i++)
+            workers.emplace_back([&, i] {
+                mounted[i] = mount(disk, partitions[i].offset);
+            });
+        for (std::thread& t : workers)
+            t.join();
+        for (size_t i = 0; i < partitions.size(); i++)
+            if (mounted[i])
+                volumes.push_back({ mounted[i], partitions[i].name });
+        return volumes;
+    }
+    static std::vector<Volume> mountAll(const std::wstring& diskPath,
+        bool directIO = false) {
+        return mountAll(std::make_shared<Disk>(diskPath, directIO), diskPath);
+    }
+};
+
+} // namespace fsread